@@ -1,641 +1,734 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "../perf/perf.h"
 #include "c8086.h"
 
+#ifndef C8086_LIBRARY
+// NOTE: images are mapped read-only, -exec copies them once into cpu->memory
 static struct buffer
 load_file(const char *path) {
-    struct buffer result;
+    struct buffer result = {};
 
-    FILE *file = fopen(path, "rb");
-    if (!file) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
         fprintf(stderr, "Cannot load '%s'\n", path);
         abort();
     }
 
-    fseek(file, 0, SEEK_END);
-    result.ndata = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    result.data = malloc(result.ndata);
-    int nread = fread(result.data, 1, result.ndata, file);
-    assert(nread == result.ndata);
+    result.ndata = info.st_size;
+    if (result.ndata) {
+        result.data = mmap(NULL, result.ndata, PROT_READ, MAP_PRIVATE, fd, 0);
+        assert(result.data != MAP_FAILED);
+    }
 
-    fclose(file);
+    close(fd);
 
     return result;
 }
 
 static void
 free_buffer(struct buffer *buffer) {
-    free(buffer->data);
+    if (buffer->data) {
+        munmap(buffer->data, buffer->ndata);
+    }
     buffer->data = NULL;
     buffer->ndata = 0;
 }
 
 static void
 usage(const char *progname) {
-    fprintf(stderr, "Usage: %s PATH [-exec]\n", progname);
+    fprintf(stderr, "Usage: %s PATH [-exec | -exec-fast | -exec-jit [-print-ip] [-stats] [-load-segment SEG]] [-bench-decode] [-bench-exec]\n", progname);
+    fprintf(stderr, "       %s PATH -bench-kernels\n", progname);
+    fprintf(stderr, "       %s PATH -exec -clocks [-8088]\n", progname);
+    fprintf(stderr, "       %s PATH -exec -profile | -profile-csv FILE | -profile-collapsed FILE\n", progname);
+    fprintf(stderr, "       %s PATH -exec [-print-ip] -trace-bin FILE\n", progname);
+    fprintf(stderr, "       %s PATH -exec [-break IP] [-watch ADDRESS[:SIZE]] [-until REG==VALUE | REG!=VALUE]\n", progname);
+    fprintf(stderr, "       %s PATH -exec | -exec-fast | -exec-jit [-stop-after N] [-snapshot FILE]\n", progname);
+    fprintf(stderr, "       %s SNAPSHOT -exec | -exec-fast | -exec-jit -resume [-stop-after N] [-snapshot FILE]\n", progname);
+    fprintf(stderr, "       %s PATH -exec | -exec-fast | -exec-jit [-memory-diff] [-dump-memory FILE]\n", progname);
+    fprintf(stderr, "       %s PATH|- -disasm-stream [-chunk-size N]\n", progname);
+    fprintf(stderr, "       %s PATH -disasm-parallel NTHREADS (0 - one per core)\n", progname);
+    fprintf(stderr, "       %s -disasm-selftest [SEED]\n", progname);
+    fprintf(stderr, "       %s -render-trace FILE\n", progname);
+    fprintf(stderr, "       %s -batch DIR [-expect DIR] [-exec | -exec-fast | -exec-jit [-print-ip] [-stats]] [-clocks [-8088]]\n", progname);
 }
+#endif
 
+// NOTE: base and index register of every rm, a zero mask drops the one it
+// lacks; rm 110 with mod 00 is the direct address, without a base
+static const struct {
+    u8 base;
+    u8 index;
+    u16 index_mask;
+} ea_registers[8] = {
+    {reg_BX, reg_SI, 0xffff},
+    {reg_BX, reg_DI, 0xffff},
+    {reg_BP, reg_SI, 0xffff},
+    {reg_BP, reg_DI, 0xffff},
+    {reg_SI, reg_SI, 0},
+    {reg_DI, reg_DI, 0},
+    {reg_BP, reg_BP, 0},
+    {reg_BX, reg_BX, 0},
+};
+
+// NOTE: no branch on rm or mod, the masks and the disp select compile to cmov
 static u16
 cpu_op_effective_address(struct cpu *cpu, struct op op) {
-    u16 address = 0;
-    switch (op.rm) {
-    case 0b000: address = cpu->regs[reg_BX] + cpu->regs[reg_SI]; break;
-    case 0b001: address = cpu->regs[reg_BX] + cpu->regs[reg_DI]; break;
-    case 0b010: address = cpu->regs[reg_BP] + cpu->regs[reg_SI]; break;
-    case 0b011: address = cpu->regs[reg_BP] + cpu->regs[reg_DI]; break;
-    case 0b100: address = cpu->regs[reg_SI]; break;
-    case 0b101: address = cpu->regs[reg_DI]; break;
-    case 0b110: {
-        if (op.mod == 0b00) {
-            address = op.addr;
-        } else {
-            address = cpu->regs[reg_BP];
-        }
-    } break;
-    case 0b111: address = cpu->regs[reg_BX]; break;
-    default: unreachable();
+    bool direct = op.mod == 0b00 && op.rm == 0b110;
+    u16 base = cpu->regs[ea_registers[op.rm].base] & ((direct) ? 0 : 0xffff);
+    u16 index = cpu->regs[ea_registers[op.rm].index] & ea_registers[op.rm].index_mask;
+    // NOTE: addr, disp and disp_byte share storage
+    u16 disp = (op.mod == 0b01) ? (u16)op.disp_byte : (u16)op.disp;
+    u16 disp_mask = (op.mod != 0b00 || direct) ? 0xffff : 0;
+    return base + index + (disp & disp_mask);
+}
+
+// NOTE: trace text and binary records are formatted by hand into one big
+// buffer that is written out in chunks, printf per field dominated tracing
+static void
+trace_write(struct trace *t, const void *data, u32 n) {
+    if (t->write) {
+        t->write(t->user, data, n);
+        return;
     }
+#ifndef C8086_LIBRARY
+    fwrite(data, 1, n, t->out);
+#endif
+}
 
-    if ((op.mod == 0b01) || (op.mod == 0b10)) {
-        i16 disp = (op.mod == 0b10) ? op.disp : op.disp_byte;
-        address += disp;
+static void
+trace_flush(struct trace *t) {
+    if (t->size) {
+        trace_write(t, t->data, t->size);
+        t->nwritten += t->size;
+        t->size = 0;
     }
+}
 
-    return address;
+static void
+trace_close(struct trace *t) {
+    trace_flush(t);
+    free(t->data);
+    t->data = NULL;
+}
+
+static u8 *
+trace_reserve(struct trace *t, u32 n) {
+    if (!t->data) {
+        t->data = malloc(TRACE_CAPACITY);
+        assert(t->data);
+    }
+    assert(n <= TRACE_CAPACITY);
+    if (t->size + n > TRACE_CAPACITY) {
+        trace_flush(t);
+    }
+    u8 *result = t->data + t->size;
+    t->size += n;
+    return result;
+}
+
+static void
+trace_bytes(struct trace *t, const void *data, u32 n) {
+    if (n > TRACE_CAPACITY / 2) {
+        // NOTE: large blocks skip the buffer
+        trace_flush(t);
+        trace_write(t, data, n);
+        t->nwritten += n;
+        return;
+    }
+    memcpy(trace_reserve(t, n), data, n);
+}
+
+static void
+trace_str(struct trace *t, const char *str) {
+    trace_bytes(t, str, strlen(str));
+}
+
+static void
+trace_char(struct trace *t, char c) {
+    *trace_reserve(t, 1) = c;
+}
+
+static void
+trace_u8(struct trace *t, u8 value) {
+    *trace_reserve(t, 1) = value;
+}
+
+static void
+trace_u16(struct trace *t, u16 value) {
+    u8 *data = trace_reserve(t, 2);
+    data[0] = value;
+    data[1] = value >> 8;
+}
+
+// NOTE: %d, or %+d when plus is set
+static void
+trace_int(struct trace *t, int value, bool plus) {
+    char digits[16];
+    int ndigits = 0;
+    unsigned magnitude = (value < 0) ? -(unsigned)value : value;
+    do {
+        digits[ndigits++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+
+    if (value < 0) {
+        trace_char(t, '-');
+    } else if (plus) {
+        trace_char(t, '+');
+    }
+    u8 *data = trace_reserve(t, ndigits);
+    for (int i = 0; i < ndigits; i++) {
+        data[i] = digits[ndigits - 1 - i];
+    }
+}
+
+// NOTE: %lu
+static void
+trace_uint(struct trace *t, u64 value) {
+    char digits[24];
+    int ndigits = 0;
+    do {
+        digits[ndigits++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    u8 *data = trace_reserve(t, ndigits);
+    for (int i = 0; i < ndigits; i++) {
+        data[i] = digits[ndigits - 1 - i];
+    }
+}
+
+// NOTE: 0x%x, or 0x%04x with min_digits 4
+static void
+trace_hex(struct trace *t, u32 value, int min_digits) {
+    static const char hex[] = "0123456789abcdef";
+    int ndigits = 1;
+    while (ndigits < 8 && (value >> (ndigits * 4))) {
+        ndigits++;
+    }
+    if (ndigits < min_digits) {
+        ndigits = min_digits;
+    }
+
+    u8 *data = trace_reserve(t, ndigits + 2);
+    data[0] = '0';
+    data[1] = 'x';
+    for (int i = 0; i < ndigits; i++) {
+        data[2 + i] = hex[(value >> ((ndigits - 1 - i) * 4)) & 0xf];
+    }
 }
 
 static void
-print_op_address(struct op op) {
-    printf("[");
+print_segment(struct trace *t, struct op op) {
+    if (op.segment) {
+        trace_str(t, sreg_name(op.segment - 1));
+        trace_char(t, ':');
+    }
+}
+
+static void
+print_op_address(struct trace *t, struct op op) {
+    trace_char(t, '[');
+    print_segment(t, op);
     switch (op.rm) {
-    case 0b000: printf("bx + si"); break;
-    case 0b001: printf("bx + di"); break;
-    case 0b010: printf("bp + si"); break;
-    case 0b011: printf("bp + di"); break;
-    case 0b100: printf("si"); break;
-    case 0b101: printf("di"); break;
+    case 0b000: trace_str(t, "bx + si"); break;
+    case 0b001: trace_str(t, "bx + di"); break;
+    case 0b010: trace_str(t, "bp + si"); break;
+    case 0b011: trace_str(t, "bp + di"); break;
+    case 0b100: trace_str(t, "si"); break;
+    case 0b101: trace_str(t, "di"); break;
     case 0b110: {
         if (op.mod == 0b00) {
-            printf("%+d", op.addr);
+            trace_int(t, op.addr, true);
         } else {
-            printf("bp");
+            trace_str(t, "bp");
         }
     } break;
-    case 0b111: printf("bx"); break;
+    case 0b111: trace_str(t, "bx"); break;
     default: unreachable();
     }
 
     if ((op.mod == 0b01) || (op.mod == 0b10)) {
         i16 disp = (op.mod == 0b10) ? op.disp : op.disp_byte;
-        if (disp == 0) {
-        } else if (disp > 0) {
-            printf("+%d",  disp);
-        } else {
-            printf("-%d",  -disp);
+        if (disp != 0) {
+            trace_int(t, disp, true);
         }
     }
 
-    printf("]");
+    trace_char(t, ']');
 }
 
 static void
-print_rm_to_reg(struct op op) {
+print_rm_to_reg(struct trace *t, struct op op) {
     if (op.mod == 0b11) {
         enum reg dst = (op.d) ? op.reg : op.rm;
         enum reg src = (op.d) ? op.rm : op.reg;
-        printf("%s, %s", reg_name(dst, op.w), reg_name(src, op.w));
+        trace_str(t, reg_name(dst, op.w));
+        trace_str(t, ", ");
+        trace_str(t, reg_name(src, op.w));
     } else {
         if (op.d) {
-            printf("%s", reg_name(op.reg, op.w));
-            printf(", ");
-            print_op_address(op);
+            trace_str(t, reg_name(op.reg, op.w));
+            trace_str(t, ", ");
+            print_op_address(t, op);
         } else {
-            print_op_address(op);
-            printf(", ");
-            printf("%s", reg_name(op.reg, op.w));
+            trace_str(t, (op.w) ? "word " : "byte ");
+            print_op_address(t, op);
+            trace_str(t, ", ");
+            trace_str(t, reg_name(op.reg, op.w));
         }
     }
 }
 
 static void
-print_im_to_reg(struct op op) {
+print_im_to_reg(struct trace *t, struct op op) {
     if (op.mod == 0b11) {
-        printf("%s", reg_name(op.rm, op.w));
+        trace_str(t, reg_name(op.rm, op.w));
     } else {
-        printf("%s ", (op.w) ? "word" : "byte");
-        print_op_address(op);
+        trace_str(t, (op.w) ? "word " : "byte ");
+        print_op_address(t, op);
     }
 }
 
+// NOTE: "name op, data" for the ops that take an immediate
+static void
+print_data(struct trace *t, u16 data) {
+    trace_str(t, ", ");
+    trace_int(t, data, false);
+}
+
+// NOTE: data of the 0x80 group, imm8 is sign-extended when s is set
+static u16
+op_immediate(struct op op) {
+    return (op.s && op.w) ? (u16)(i8)op.data_byte : op.data;
+}
+
+// NOTE: a sign-extended imm8 prints negative, so yasm picks 0x83 for it again
+static void
+print_immediate(struct trace *t, struct op op) {
+    trace_str(t, ", ");
+    trace_int(t, (op.s && op.w) ? (i16)op_immediate(op) : op.data, false);
+}
+
+static void
+print_jump(struct trace *t, const char *name, struct op op) {
+    trace_str(t, name);
+    trace_str(t, " $");
+    trace_int(t, op.ip_inc, true);
+}
+
 static void
-print_op(struct op op) {
+print_op(struct trace *t, struct op op) {
     // NOTE: d == 1 : dst in reg
     switch (op.type) {
-    case op_UNKNOWN: {
+    case op_UNKNOWN:
+    case op_num: {
         assert(!"Cannot print uknown op");
     } break;
     case op_MOV_RM_TO_REG: {
-        printf("mov ");
-        print_rm_to_reg(op);
+        trace_str(t, "mov ");
+        print_rm_to_reg(t, op);
     } break;
     case op_MOV_IMM_TO_RM: {
-        printf("mov ");
-        printf("%s", (op.w) ? "word " : "byte ");
-        print_op_address(op);
-        printf(", %d", op.data);
+        trace_str(t, "mov ");
+        trace_str(t, (op.w) ? "word " : "byte ");
+        print_op_address(t, op);
+        print_data(t, op.data);
     } break;
     case op_MOV_ACC_TO_MEM: {
-        printf("mov [%d], ax", op.addr);
+        trace_str(t, "mov [");
+        print_segment(t, op);
+        trace_int(t, op.addr, false);
+        trace_str(t, "], ");
+        trace_str(t, reg_name(reg_AX, op.w));
     } break;
     case op_MOV_MEM_TO_ACC: {
-        printf("mov ax, [%d]", op.addr);
+        trace_str(t, "mov ");
+        trace_str(t, reg_name(reg_AX, op.w));
+        trace_str(t, ", [");
+        print_segment(t, op);
+        trace_int(t, op.addr, false);
+        trace_str(t, "]");
+    } break;
+    case op_MOV_RM_TO_SREG: {
+        trace_str(t, "mov ");
+        trace_str(t, sreg_name(op.reg & 0b11));
+        trace_str(t, ", ");
+        print_im_to_reg(t, op);
+    } break;
+    case op_MOV_SREG_TO_RM: {
+        trace_str(t, "mov ");
+        print_im_to_reg(t, op);
+        trace_str(t, ", ");
+        trace_str(t, sreg_name(op.reg & 0b11));
     } break;
     case op_MOV_IMM_TO_REG: {
-        printf("mov %s, %d", reg_name(op.reg, op.w), (op.w) ? op.data : op.data_byte);
+        trace_str(t, "mov ");
+        trace_str(t, reg_name(op.reg, op.w));
+        print_data(t, (op.w) ? op.data : op.data_byte);
     } break;
     case op_ADD: {
-        printf("add ");
-        print_rm_to_reg(op);
+        trace_str(t, "add ");
+        print_rm_to_reg(t, op);
     } break;
     case op_ADD_IMM_TO_RM: {
-        printf("add ");
-        print_im_to_reg(op);
-        printf(", %d", op.data);
+        trace_str(t, "add ");
+        print_im_to_reg(t, op);
+        print_immediate(t, op);
     } break;
     case op_ADD_IMM_TO_ACC: {
-        printf("add %s, %d", reg_name(0, op.w), op.data);
+        trace_str(t, "add ");
+        trace_str(t, reg_name(0, op.w));
+        print_data(t, op.data);
     } break;
     case op_SUB: {
-        printf("sub ");
-        print_rm_to_reg(op);
+        trace_str(t, "sub ");
+        print_rm_to_reg(t, op);
     } break;
     case op_SUB_IMM_TO_RM: {
-        printf("sub ");
-        print_im_to_reg(op);
-        printf(", %d", op.data);
+        trace_str(t, "sub ");
+        print_im_to_reg(t, op);
+        print_immediate(t, op);
     } break;
     case op_SUB_IMM_TO_ACC: {
-        printf("sub %s, %d", reg_name(0, op.w), op.data);
+        trace_str(t, "sub ");
+        trace_str(t, reg_name(0, op.w));
+        print_data(t, op.data);
     } break;
     case op_CMP: {
-        printf("cmp ");
-        print_rm_to_reg(op);
+        trace_str(t, "cmp ");
+        print_rm_to_reg(t, op);
     } break;
     case op_CMP_IMM_TO_RM: {
-        printf("cmp ");
-        print_im_to_reg(op);
-        printf(", %d", op.data);
+        trace_str(t, "cmp ");
+        print_im_to_reg(t, op);
+        print_immediate(t, op);
     } break;
     case op_CMP_IMM_TO_ACC: {
-        printf("cmp %s, %d", reg_name(0, op.w), op.data);
+        trace_str(t, "cmp ");
+        trace_str(t, reg_name(0, op.w));
+        print_data(t, op.data);
     } break;
-    case op_JE: printf("je $%+d", op.ip_inc); break;
-    case op_JL: printf("jl $%+d", op.ip_inc); break;
-    case op_JLE: printf("jle $%+d", op.ip_inc); break;
-    case op_JB: printf("jb $%+d", op.ip_inc); break;
-    case op_JBE: printf("jbe $%+d", op.ip_inc); break;
-    case op_JP: printf("jp $%+d", op.ip_inc); break;
-    case op_JO: printf("jo $%+d", op.ip_inc); break;
-    case op_JS: printf("js $%+d", op.ip_inc); break;
-    case op_JNE: printf("jne $%+d", op.ip_inc); break;
-    case op_JNL: printf("jnl $%+d", op.ip_inc); break;
-    case op_JG: printf("jg $%+d", op.ip_inc); break;
-    case op_JNB: printf("jnb $%+d", op.ip_inc); break;
-    case op_JA: printf("ja $%+d", op.ip_inc); break;
-    case op_JNP: printf("jnp $%+d", op.ip_inc); break;
-    case op_JNO: printf("jno $%+d", op.ip_inc); break;
-    case op_JNS: printf("jns $%+d", op.ip_inc); break;
-    case op_LOOP: printf("loop $%+d", op.ip_inc); break;
-    case op_LOOPZ: printf("loopz $%+d", op.ip_inc); break;
-    case op_LOOPNZ: printf("loopnz $%+d", op.ip_inc); break;
-    case op_JCXZ: printf("jcxz $%+d", op.ip_inc); break;
+    case op_JE: print_jump(t, "je", op); break;
+    case op_JL: print_jump(t, "jl", op); break;
+    case op_JLE: print_jump(t, "jle", op); break;
+    case op_JB: print_jump(t, "jb", op); break;
+    case op_JBE: print_jump(t, "jbe", op); break;
+    case op_JP: print_jump(t, "jp", op); break;
+    case op_JO: print_jump(t, "jo", op); break;
+    case op_JS: print_jump(t, "js", op); break;
+    case op_JNE: print_jump(t, "jne", op); break;
+    case op_JNL: print_jump(t, "jnl", op); break;
+    case op_JG: print_jump(t, "jg", op); break;
+    case op_JNB: print_jump(t, "jnb", op); break;
+    case op_JA: print_jump(t, "ja", op); break;
+    case op_JNP: print_jump(t, "jnp", op); break;
+    case op_JNO: print_jump(t, "jno", op); break;
+    case op_JNS: print_jump(t, "jns", op); break;
+    case op_LOOP: print_jump(t, "loop", op); break;
+    case op_LOOPZ: print_jump(t, "loopz", op); break;
+    case op_LOOPNZ: print_jump(t, "loopnz", op); break;
+    case op_JCXZ: print_jump(t, "jcxz", op); break;
     }
 }
 
-static u8
-cpu_read_next_byte(struct cpu *cpu) {
-    assert(cpu->ip < cpu->nbytes);
-    u8 result = cpu->instructions[cpu->ip++];
-    return result;
-}
+// NOTE: operand format bits of a decode table entry
+enum desc {
+    desc_MODRM = 0x1,   // mod/reg/rm byte follows, then displacement
+    desc_D = 0x2,       // d in bit 1
+    desc_S = 0x4,       // s in bit 1
+    desc_W = 0x8,       // w in bit 0
+    desc_W3 = 0x10,     // w in bit 3
+    desc_REG3 = 0x20,   // reg in bits 0..2
+    desc_DATA = 0x40,   // immediate data, one or two bytes depending on s/w
+    desc_ADDR = 0x80,   // 16-bit direct address
+    desc_IP_INC = 0x100, // 8-bit signed jump offset
+    desc_ACC = 0x200,   // implicit accumulator
+    desc_GROUP = 0x400, // op type selected by the reg field
+    desc_W1 = 0x800,    // always a word op
+    desc_SEGMENT = 0x1000, // segment override prefix, sr in bits 3..4
+};
 
-static void
-cpu_read_disp(struct cpu *cpu, struct op *op) {
-    if (op->mod == 0b00) {
-        if (op->rm == 0b110) {
-            u8 low = cpu_read_next_byte(cpu);
-            u8 high = cpu_read_next_byte(cpu);
-            op->disp = (high << 8) | low;
-        }
-    } else if (op->mod == 0b01) {
-        op->disp = cpu_read_next_byte(cpu);
-    } else if (op->mod == 0b10) {
-        u8 low = cpu_read_next_byte(cpu);
-        u8 high = cpu_read_next_byte(cpu);
-        op->disp = (high << 8) | low;
-    }
-}
+struct op_desc {
+    enum op_type type;
+    enum desc format;
+    const enum op_type *group;
+};
 
-static void
-cpu_read_data(struct cpu *cpu, struct op *op) {
-    op->data = cpu_read_next_byte(cpu);
-    if (!op->s && op->w) {
-        u8 high = cpu_read_next_byte(cpu);
-        op->data |= (high << 8);
-    }
-}
+static const enum op_type group_immediate[8] = {
+    [0b000] = op_ADD_IMM_TO_RM,
+    [0b101] = op_SUB_IMM_TO_RM,
+    [0b111] = op_CMP_IMM_TO_RM,
+};
 
-static void
-cpu_read_mod_reg_rm(struct cpu *cpu, struct op *op) {
-    u8 second_byte = cpu_read_next_byte(cpu);
-    op->mod = (second_byte >> 6) & 0b11;
-    op->reg = (second_byte >> 3) & 0b111;
-    op->rm =  (second_byte >> 0) & 0b111;
-}
+static const enum op_type group_mov_immediate[8] = {
+    [0b000] = op_MOV_IMM_TO_RM,
+};
 
-static void
-flags_print(enum flags flags) {
-    if (flags & flags_CARRY) printf("C");
-    if (flags & flags_PARITY) printf("P");
-    if (flags & flags_AUX_CARRY) printf("A");
-    if (flags & flags_ZERO) printf("Z");
-    if (flags & flags_SIGN) printf("S");
-    if (flags & flags_OVERFLOW) printf("O");
-}
+#define JUMP(t) {(t), desc_IP_INC}
 
-static void
-cpu_advance_ip(struct cpu *cpu) {
-    if (cpu->print_ip) {
-        printf(" ip:0x%x->0x%x", cpu->last_ip, cpu->ip);
-    }
-    cpu->last_ip = cpu->ip;
-}
+static const struct op_desc decode_table[256] = {
+    [0x00 ... 0x03] = {op_ADD, desc_MODRM | desc_D | desc_W},
+    [0x04 ... 0x05] = {op_ADD_IMM_TO_ACC, desc_W | desc_DATA | desc_ACC},
+    [0x26] = {op_UNKNOWN, desc_SEGMENT},
+    [0x28 ... 0x2b] = {op_SUB, desc_MODRM | desc_D | desc_W},
+    [0x2c ... 0x2d] = {op_SUB_IMM_TO_ACC, desc_W | desc_DATA | desc_ACC},
+    [0x2e] = {op_UNKNOWN, desc_SEGMENT},
+    [0x36] = {op_UNKNOWN, desc_SEGMENT},
+    [0x38 ... 0x3b] = {op_CMP, desc_MODRM | desc_D | desc_W},
+    [0x3c ... 0x3d] = {op_CMP_IMM_TO_ACC, desc_W | desc_DATA | desc_ACC},
+    [0x3e] = {op_UNKNOWN, desc_SEGMENT},
 
-static void
-cpu_exec(struct cpu *cpu, struct op op) {
-    printf(" ; ");
+    [0x70] = JUMP(op_JO),
+    [0x71] = JUMP(op_JNO),
+    [0x72] = JUMP(op_JB),
+    [0x73] = JUMP(op_JNB),
+    [0x74] = JUMP(op_JE),
+    [0x75] = JUMP(op_JNE),
+    [0x76] = JUMP(op_JBE),
+    [0x77] = JUMP(op_JA),
+    [0x78] = JUMP(op_JS),
+    [0x79] = JUMP(op_JNS),
+    [0x7a] = JUMP(op_JP),
+    [0x7b] = JUMP(op_JNP),
+    [0x7c] = JUMP(op_JL),
+    [0x7d] = JUMP(op_JNL),
+    [0x7e] = JUMP(op_JLE),
+    [0x7f] = JUMP(op_JG),
 
-    enum flags old_flags = cpu->flags;
+    [0x80 ... 0x83] = {op_UNKNOWN, desc_MODRM | desc_S | desc_W | desc_DATA | desc_GROUP, group_immediate},
+    [0x88 ... 0x8b] = {op_MOV_RM_TO_REG, desc_MODRM | desc_D | desc_W},
+    [0x8c] = {op_MOV_SREG_TO_RM, desc_MODRM | desc_W1},
+    [0x8e] = {op_MOV_RM_TO_SREG, desc_MODRM | desc_W1},
+    [0xa0 ... 0xa1] = {op_MOV_MEM_TO_ACC, desc_W | desc_ADDR | desc_ACC},
+    [0xa2 ... 0xa3] = {op_MOV_ACC_TO_MEM, desc_W | desc_ADDR | desc_ACC},
+    [0xb0 ... 0xbf] = {op_MOV_IMM_TO_REG, desc_W3 | desc_REG3 | desc_DATA},
+    [0xc6 ... 0xc7] = {op_UNKNOWN, desc_MODRM | desc_W | desc_DATA | desc_GROUP, group_mov_immediate},
 
-    switch (op.type) {
-    case op_MOV_IMM_TO_RM: {
-        u16 address = cpu_op_effective_address(cpu, op);
-        cpu->memory[address] = op.data;
-    } break;
-    case op_MOV_IMM_TO_REG: {
-        u16 old = cpu->regs[op.reg];
-        u16 new = cpu->regs[op.reg] = op.data;
-        printf("%s:0x%x->0x%x", reg_name(op.reg, op.w), old, new);
-    } break;
-    case op_MOV_RM_TO_REG: {
-        if (op.mod == 0b11) {
-            enum reg dst = (op.d) ? op.reg : op.rm;
-            enum reg src = (op.d) ? op.rm : op.reg;
-            u16 old = cpu->regs[dst];
-            u16 new = cpu->regs[dst] = cpu->regs[src];
-            printf("%s:0x%x->0x%x", reg_name(dst, op.w), old, new);
-        } else {
-            u16 address = cpu_op_effective_address(cpu, op);
-            u16 old = cpu->regs[op.reg];
-            u16 new = cpu->memory[address];
-            cpu->regs[op.reg] = new;
-            printf("%s:0x%x->0x%x", reg_name(op.reg, op.w), old, new);
+    [0xe0] = JUMP(op_LOOPNZ),
+    [0xe1] = JUMP(op_LOOPZ),
+    [0xe2] = JUMP(op_LOOP),
+    [0xe3] = JUMP(op_JCXZ),
+};
+
+#undef JUMP
+
+// NOTE: longest supported encoding: prefix, opcode, mod/reg/rm, disp16, data16
+#define OP_MAX_SIZE 7
+
+// NOTE: returns the size of the decoded instruction, 0 if it is cut off
+// by the end of the buffer and -1 if the opcode is not supported
+static int
+decode_op(const u8 *bytes, u32 nbytes, struct op *op) {
+    if (nbytes == 0) {
+        return 0;
+    }
+
+    u8 segment = 0;
+    u32 prefix_size = 0;
+    if (decode_table[bytes[0]].format & desc_SEGMENT) {
+        segment = ((bytes[0] >> 3) & 0b11) + 1;
+        prefix_size = 1;
+        bytes++;
+        nbytes--;
+        if (nbytes == 0) {
+            return 0;
         }
-    } break;
-    case op_ADD: {
-        enum reg dst = (op.d) ? op.reg : op.rm;
-        enum reg src = (op.d) ? op.rm : op.reg;
-        u16 old = cpu->regs[dst];
-        u16 new = old + cpu->regs[src];
-        cpu->regs[op.reg] = new;
-        printf("%s:0x%x->0x%x", reg_name(dst, op.w), old, new);
-    } break;
-    case op_ADD_IMM_TO_RM: {
-        u16 old = cpu->regs[op.rm];
-        u16 new = cpu->regs[op.rm] + op.data;
-        cpu->regs[op.rm] = new;
-        bool aux_carry = ((old & 0xf) + (op.data & 0xf)) > 0xf;
-        if (aux_carry) {
-            cpu->flags |= flags_AUX_CARRY;
-        } else {
-            cpu->flags &= ~flags_AUX_CARRY;
+    }
+
+    u8 first_byte = bytes[0];
+    struct op_desc desc = decode_table[first_byte];
+    enum desc format = desc.format;
+    if (!format || (format & desc_SEGMENT)) {
+        return -1;
+    }
+
+    // NOTE: fields are decoded into plain locals and packed into op once
+    enum op_type type = desc.type;
+    u8 d = 0, s = 0, w = 0, mod = 0;
+    enum reg reg = 0, rm = 0;
+    u16 disp = 0, data = 0;
+    if (format & desc_D) d = (first_byte >> 1) & 1;
+    if (format & desc_S) s = (first_byte >> 1) & 1;
+    if (format & desc_W) w = first_byte & 1;
+    if (format & desc_W1) w = 1;
+    if (format & desc_W3) w = (first_byte >> 3) & 1;
+    if (format & desc_REG3) reg = first_byte & 0b111;
+    if (format & desc_ACC) reg = reg_AX;
+
+    u32 size = 1;
+    if (format & desc_MODRM) {
+        if (nbytes < 2) {
+            return 0;
         }
-        int parity = 0;
-        for (int i = 0; i < 8; i++) {
-            if ((new >> i) & 0x1) {
-                parity++;
+        u8 second_byte = bytes[1];
+        mod = (second_byte >> 6) & 0b11;
+        reg = (second_byte >> 3) & 0b111;
+        rm =  (second_byte >> 0) & 0b111;
+        size = 2;
+
+        if (format & desc_GROUP) {
+            type = desc.group[reg];
+            if (!type) {
+                return -1;
             }
         }
-        if (parity & 0x1) {
-            cpu->flags &= ~flags_PARITY;
-        } else {
-            cpu->flags |= flags_PARITY;
+
+        u32 disp_size = 0;
+        if (mod == 0b01) {
+            disp_size = 1;
+        } else if (mod == 0b10 || (mod == 0b00 && rm == 0b110)) {
+            disp_size = 2;
         }
-        printf("%s:0x%x->0x%x", reg_name(op.rm, op.w), old, new);
-    } break;
-    case op_SUB: {
-        enum reg dst = (op.d) ? op.reg : op.rm;
-        enum reg src = (op.d) ? op.rm : op.reg;
-        u16 old = cpu->regs[dst];
-        u16 sub = cpu->regs[src];
-        u16 new = old - sub;
-        cpu->regs[dst] = new;
-        if ((i16)new < 0) {
-            cpu->flags |= flags_SIGN;
-        }
-        bool carry = (old & 0xff) < (sub & 0xff);
-        if (carry) {
-            cpu->flags |= flags_CARRY;
-        } else {
-            cpu->flags &= ~flags_CARRY;
+        if (nbytes < size + disp_size) {
+            return 0;
         }
-        bool aux_carry = (sub & 0xf) > (old & 0xf);
-        if (aux_carry) {
-            cpu->flags |= flags_AUX_CARRY;
-        } else {
-            cpu->flags &= ~flags_AUX_CARRY;
+        if (disp_size == 1) {
+            disp = (i8)bytes[size];
+        } else if (disp_size == 2) {
+            disp = bytes[size] | (bytes[size + 1] << 8);
         }
-        printf("%s:0x%x->0x%x", reg_name(dst, op.w), old, new);
+        size += disp_size;
+    }
 
-    } break;
-    case op_SUB_IMM_TO_RM: {
-        u16 old = cpu->regs[op.rm];
-        u16 sub = op.data;
-        u16 new = old - sub;
-        cpu->regs[op.rm] = new;
-        if ((i16)new < 0) {
-            cpu->flags |= flags_SIGN;
-        }
-        if (new == 0) {
-            cpu->flags |= flags_ZERO;
-            cpu->flags |= flags_PARITY;
-        }
-        bool aux_carry = (sub & 0xf) > (old & 0xf);
-        if (aux_carry) {
-            cpu->flags |= flags_AUX_CARRY;
-        } else {
-            cpu->flags &= ~flags_AUX_CARRY;
-        }
-        int parity = 0;
-        for (int i = 0; i < 8; i++) {
-            if ((new >> i) & 0x1) {
-                parity++;
-            }
+    if (format & (desc_ADDR | desc_IP_INC | desc_DATA)) {
+        u32 data_size = ((format & desc_ADDR) || ((format & desc_DATA) && !s && w)) ? 2 : 1;
+        if (nbytes < size + data_size) {
+            return 0;
         }
-        if (parity & 0x1) {
-            cpu->flags &= ~flags_PARITY;
-        } else {
-            cpu->flags |= flags_PARITY;
+        u16 value = bytes[size];
+        if (data_size == 2) {
+            value |= bytes[size + 1] << 8;
         }
-        printf("%s:0x%x->0x%x", reg_name(op.rm, op.w), old, new);
-    } break;
-    case op_CMP: {
-        enum reg dst = (op.d) ? op.reg : op.rm;
-        enum reg src = (op.d) ? op.rm : op.reg;
-        i16 diff = cpu->regs[dst] - cpu->regs[src];
+        size += data_size;
 
-        cpu->flags &= ~flags_SIGN;
-        if (diff == 0) {
-            cpu->flags |= flags_ZERO;
-            cpu->flags |= flags_PARITY;
-        }
-    } break;
-    case op_JNE: {
-        if (!(cpu->flags & flags_ZERO)) {
-            cpu->ip = cpu->last_ip + op.ip_inc;
+        if (format & desc_ADDR) {
+            disp = value; // NOTE: addr
+        } else if (format & desc_IP_INC) {
+            disp = (u8)(value + 2); // NOTE: ip_inc, add op offset
+        } else {
+            data = value;
         }
-    } break;
-    default:
-        printf("skipping %d", op.type);
     }
 
-    cpu_advance_ip(cpu);
-
-    if (old_flags != cpu->flags) {
-        printf(" flags:");
-        flags_print(old_flags);
-        printf("->");
-        flags_print(cpu->flags);
-    }
+    *op = (struct op){
+        .type = type,
+        .d = d,
+        .s = s,
+        .w = w,
+        .mod = mod,
+        .segment = segment,
+        .reg = reg,
+        .rm = rm,
+        .disp = disp,
+        .data = data,
+    };
+    return prefix_size + size;
 }
 
 static void
-cpu_add_and_exec(struct cpu *cpu, struct prog *prog, struct op op) {
-#if DEBUG
-    dbg(op);
-#endif
-    print_op(op);
-    if (cpu->powered) {
-        cpu_exec(cpu, op);
-    }
-    printf("\n");
-
-    assert(prog->nops < len(prog->ops));
-    prog->ops[prog->nops++] = op;
+flags_print(struct trace *t, enum flags flags) {
+    if (flags & flags_CARRY) trace_char(t, 'C');
+    if (flags & flags_PARITY) trace_char(t, 'P');
+    if (flags & flags_AUX_CARRY) trace_char(t, 'A');
+    if (flags & flags_ZERO) trace_char(t, 'Z');
+    if (flags & flags_SIGN) trace_char(t, 'S');
+    if (flags & flags_OVERFLOW) trace_char(t, 'O');
 }
 
+// NOTE: one line of -exec output, op is the decoded record bytes
+static void
+trace_text_record(struct trace *t, const struct trace_record *record, struct op op, bool print_ip) {
+    print_op(t, op);
+    trace_str(t, " ;");
 
-static struct prog
-cpu_run(struct cpu *cpu, struct buffer asm_data) {
-    struct prog result = {};
+    if (record->kind == trace_SKIPPED_OP) {
+        trace_str(t, " skipping ");
+        trace_int(t, op.type, false);
+    }
 
-    cpu->instructions = asm_data.data;
-    cpu->nbytes = asm_data.ndata;
-
-    while (cpu->ip < cpu->nbytes) {
-        u8 first_byte = cpu_read_next_byte(cpu);
-        u8 opcode = first_byte >> 2;
-        switch (opcode) {
-        case 0b100010: {
-            // NOTE: mov Register/memory to/from register
-            struct op op = {
-                .type = op_MOV_RM_TO_REG,
-                .d = (first_byte >> 1) & 1,
-                .w = first_byte & 1,
-            };
-            cpu_read_mod_reg_rm(cpu, &op);
-            cpu_read_disp(cpu, &op);
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-        case 0b110001: {
-            // NOTE: mov Immediate to register/memory
-            assert(((first_byte >> 1) & 0b1) == 0b1);
-
-            struct op op = {
-                .type = op_MOV_IMM_TO_RM,
-                .w = first_byte & 1,
-            };
-            cpu_read_mod_reg_rm(cpu, &op);
-            assert(op.reg == 0);
-            cpu_read_disp(cpu, &op);
-            cpu_read_data(cpu, &op);
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-        case 0b101000: {
-            // NOTE: mov Memory to accumulator
-            // NOTE: mov Accumulator to memory
-            struct op op = {
-                .w = first_byte & 1,
-                .reg = reg_AX,
-            };
-
-            switch ((first_byte & 0b1110)) {
-            case 0b0000: op.type = op_MOV_MEM_TO_ACC; break;
-            case 0b0010: op.type = op_MOV_ACC_TO_MEM; break;
-            default: unreachable();
-            }
-
-            u8 addr_low = cpu_read_next_byte(cpu);
-            u8 addr_hi = cpu_read_next_byte(cpu);
-            op.addr = (addr_hi << 8) | addr_low;
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-        case 0b000000: {
-            // NOTE: add register/memory with register to either
-            struct op op = {
-                .type = op_ADD,
-                .d = (first_byte >> 1) & 1,
-                .w = first_byte & 1,
-            };
-            cpu_read_mod_reg_rm(cpu, &op);
-            cpu_read_disp(cpu, &op);
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-        case 0b100000: {
-            struct op op = {
-                .s = (first_byte >> 1) & 1,
-                .w = first_byte & 1,
-            };
-            cpu_read_mod_reg_rm(cpu, &op);
-            switch (op.reg) {
-            case 0b000:
-                // NOTE: add immediate to register/memory
-                op.type = op_ADD_IMM_TO_RM;
-                break;
-            case 0b101:
-                // NOTE: sub immediate to register/memory
-                op.type = op_SUB_IMM_TO_RM;
-                break;
-            case 0b111:
-                // NOTE: cmp immediate with register/memory
-                op.type = op_CMP_IMM_TO_RM;
-                break;
-            default:
-                unimplemented();
-            }
-
-            cpu_read_disp(cpu, &op);
-            cpu_read_data(cpu, &op);
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-        case 0b000001: {
-            // NOTE: add immediate to accumulator
-            struct op op = {
-                .type = op_ADD_IMM_TO_ACC,
-                .w = first_byte & 1,
-            };
-            cpu_read_data(cpu, &op);
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-        case 0b001010: {
-            // NOTE: sub register/memory with register to either
-            struct op op = {
-                .type = op_SUB,
-                .d = (first_byte >> 1) & 1,
-                .w = first_byte & 1,
-            };
-            cpu_read_mod_reg_rm(cpu, &op);
-            cpu_read_disp(cpu, &op);
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-        case 0b001011: {
-            // NOTE: sub immediate to accumulator
-            struct op op = {
-                .type = op_SUB_IMM_TO_ACC,
-                .w = first_byte & 1,
-            };
-            cpu_read_data(cpu, &op);
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-
-        case 0b001110: {
-            // NOTE: cmp register/memory and register
-            struct op op = {
-                .type = op_CMP,
-                .d = (first_byte >> 1) & 1,
-                .w = first_byte & 1,
-            };
-            cpu_read_mod_reg_rm(cpu, &op);
-            cpu_read_disp(cpu, &op);
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-        case 0b001111: {
-            // NOTE: cmp immediate with accumulator
-            struct op op = {
-                .type = op_CMP_IMM_TO_ACC,
-                .w = first_byte & 1,
-            };
-            cpu_read_data(cpu, &op);
-            cpu_add_and_exec(cpu, &result, op);
-        } break;
-        default: {
-            enum op_type jumps[255] = {
-                [0b01110100] = op_JE,
-                [0b01111100] = op_JL,
-                [0b01111110] = op_JLE,
-                [0b01110010] = op_JB,
-                [0b01110110] = op_JBE,
-                [0b01111010] = op_JP,
-                [0b01110000] = op_JO,
-                [0b01111000] = op_JS,
-                [0b01110101] = op_JNE,
-                [0b01111101] = op_JNL,
-                [0b01111111] = op_JG,
-                [0b01110011] = op_JNB,
-                [0b01110111] = op_JA,
-                [0b01111011] = op_JNP,
-                [0b01110001] = op_JNO,
-                [0b01111001] = op_JNS,
-                [0b11100010] = op_LOOP,
-                [0b11100001] = op_LOOPZ,
-                [0b11100000] = op_LOOPNZ,
-                [0b11100011] = op_JCXZ,
-            };
-            if (jumps[first_byte]) {
-                struct op op = {
-                    .type = jumps[first_byte],
-                    .ip_inc = cpu_read_next_byte(cpu) + 2, // NOTE: add op offset
-                };
-                cpu_add_and_exec(cpu, &result, op);
-            } else if ((first_byte >> 4) == 0b1011) {
-                // NOTE: mov Immediate to register
-                struct op op = {
-                    .type = op_MOV_IMM_TO_REG,
-                    .w = first_byte & 0b1000,
-                    .reg = first_byte & 0b111,
-                };
-                cpu_read_data(cpu, &op);
-                cpu_add_and_exec(cpu, &result, op);
-                break;
-            } else {
-                assert(!"Unsupported op");
+    // NOTE: "Clocks: +14 = 36 (8 + 6ea)", the parts only when there is more than base
+    const struct clocks *clocks = &record->clocks;
+    if (clocks->base) {
+        trace_str(t, " Clocks: +");
+        trace_int(t, clocks->base + clocks->ea + clocks->penalty, false);
+        trace_str(t, " = ");
+        trace_uint(t, record->total_clocks);
+        if (clocks->ea || clocks->penalty) {
+            trace_str(t, " (");
+            trace_int(t, clocks->base, false);
+            if (clocks->ea) {
+                trace_str(t, " + ");
+                trace_int(t, clocks->ea, false);
+                trace_str(t, "ea");
             }
-        } break;
+            if (clocks->penalty) {
+                trace_str(t, " + ");
+                trace_int(t, clocks->penalty, false);
+                trace_str(t, "p");
+            }
+            trace_char(t, ')');
         }
+        trace_str(t, " |");
     }
 
-    return result;
+    for (int i = 0; i < reg_num; i++) {
+        if (record->old_regs[i] != record->new_regs[i]) {
+            trace_char(t, ' ');
+            trace_str(t, reg_name(i, 1));
+            trace_char(t, ':');
+            trace_hex(t, record->old_regs[i], 1);
+            trace_str(t, "->");
+            trace_hex(t, record->new_regs[i], 1);
+        }
+    }
+
+    for (int i = 0; i < sreg_num; i++) {
+        if (record->old_sregs[i] != record->new_sregs[i]) {
+            trace_char(t, ' ');
+            trace_str(t, sreg_name(i));
+            trace_char(t, ':');
+            trace_hex(t, record->old_sregs[i], 1);
+            trace_str(t, "->");
+            trace_hex(t, record->new_sregs[i], 1);
+        }
+    }
+
+    if (print_ip) {
+        trace_str(t, " ip:");
+        trace_hex(t, record->ip, 1);
+        trace_str(t, "->");
+        trace_hex(t, record->next_ip, 1);
+    }
+
+    if (record->old_flags != record->new_flags) {
+        trace_str(t, " flags:");
+        flags_print(t, record->old_flags);
+        trace_str(t, "->");
+        flags_print(t, record->new_flags);
+    }
+
+    trace_char(t, '\n');
 }
 
 static void
-cpu_print_regs(struct cpu *cpu) {
-    printf("Final registers:\n");
-    enum reg order[reg_num] = {
+trace_regs(struct trace *t, const u16 regs[reg_num], const u16 sregs[sreg_num], u16 ip, enum flags flags, bool print_ip) {
+    static const enum reg order[reg_num] = {
         reg_AX,
         reg_BX,
         reg_CX,
@@ -645,62 +738,3329 @@ cpu_print_regs(struct cpu *cpu) {
         reg_SI,
         reg_DI,
     };
+
+    trace_str(t, "Final registers:\n");
     for (int i = 0; i < reg_num; i++) {
         enum reg reg = order[i];
-        u16 value = cpu->regs[reg];
+        u16 value = regs[reg];
         if (value) {
-            printf("\t%s: 0x%04x (%d)\n", reg_name(reg, 1), value, value);
+            trace_char(t, '\t');
+            trace_str(t, reg_name(reg, 1));
+            trace_str(t, ": ");
+            trace_hex(t, value, 4);
+            trace_str(t, " (");
+            trace_int(t, value, false);
+            trace_str(t, ")\n");
+        }
+    }
+    for (int i = 0; i < sreg_num; i++) {
+        if (sregs[i]) {
+            trace_char(t, '\t');
+            trace_str(t, sreg_name(i));
+            trace_str(t, ": ");
+            trace_hex(t, sregs[i], 4);
+            trace_str(t, " (");
+            trace_int(t, sregs[i], false);
+            trace_str(t, ")\n");
         }
     }
-    if (cpu->print_ip) {
-        printf("\tip: 0x%04x (%d)\n", cpu->ip, cpu->ip);
+    if (print_ip) {
+        trace_str(t, "\tip: ");
+        trace_hex(t, ip, 4);
+        trace_str(t, " (");
+        trace_int(t, ip, false);
+        trace_str(t, ")\n");
     }
-    if (cpu->flags) {
-        printf("\tflags: ");
-        flags_print(cpu->flags);
-        printf("\n");
+    if (flags) {
+        trace_str(t, "\tflags: ");
+        flags_print(t, flags);
+        trace_char(t, '\n');
     }
 }
 
-int
-main(int argc, char *argv[]) {
-    if (argc < 2) {
-        usage(argv[0]);
-        exit(0);
-    }
+// NOTE: binary trace, little-endian:
+//   header  "C86T", u8 version, u8 print_ip, u16 path length, path
+//   op      u8 kind, u16 ip, u16 next_ip, u8 size, size instruction bytes,
+//           u8 old flags, u8 new flags, u8 changed register mask,
+//           then u16 old, u16 new for every register in the mask,
+//           the same for segment registers
+//   final   u8 trace_FINAL, u16 regs[reg_num], u16 sregs[sreg_num], u16 ip, u8 flags
+#define TRACE_MAGIC "C86T"
+#define TRACE_VERSION 2
 
-    struct cpu cpu = {};
-    if (argc > 2) {
-        if (strcmp(argv[2], "-exec")) {
-            usage(argv[0]);
-            exit(0);
+// NOTE: mask of the entries that differ, followed by their old and new values
+static void
+trace_binary_deltas(struct trace *t, const u16 *old_values, const u16 *new_values, int n) {
+    u8 changed = 0;
+    for (int i = 0; i < n; i++) {
+        if (old_values[i] != new_values[i]) {
+            changed |= 1 << i;
         }
+    }
+    trace_u8(t, changed);
+    for (int i = 0; i < n; i++) {
+        if (changed & (1 << i)) {
+            trace_u16(t, old_values[i]);
+            trace_u16(t, new_values[i]);
+        }
+    }
+}
 
-        cpu.powered = true;
+#ifndef C8086_LIBRARY
+static void
+trace_binary_header(struct trace *t, const char *path, bool print_ip) {
+    u16 npath = strlen(path);
+    trace_bytes(t, TRACE_MAGIC, 4);
+    trace_u8(t, TRACE_VERSION);
+    trace_u8(t, print_ip);
+    trace_u16(t, npath);
+    trace_bytes(t, path, npath);
+}
+#endif
 
-        if (argc > 3 && strcmp(argv[3], "-print-ip") == 0) {
-            cpu.print_ip = true;
-        }
+static void
+trace_binary_record(struct trace *t, const struct trace_record *record) {
+    trace_u8(t, record->kind);
+    trace_u16(t, record->ip);
+    trace_u16(t, record->next_ip);
+    trace_u8(t, record->size);
+    trace_bytes(t, record->bytes, record->size);
+    trace_u8(t, record->old_flags);
+    trace_u8(t, record->new_flags);
+    trace_binary_deltas(t, record->old_regs, record->new_regs, reg_num);
+    trace_binary_deltas(t, record->old_sregs, record->new_sregs, sreg_num);
+}
+
+#ifndef C8086_LIBRARY
+static void
+trace_binary_final(struct trace *t, const u16 regs[reg_num], const u16 sregs[sreg_num], u16 ip, enum flags flags) {
+    trace_u8(t, trace_FINAL);
+    for (int i = 0; i < reg_num; i++) {
+        trace_u16(t, regs[i]);
+    }
+    for (int i = 0; i < sreg_num; i++) {
+        trace_u16(t, sregs[i]);
+    }
+    trace_u16(t, ip);
+    trace_u8(t, flags);
+}
+#endif
+
+// NOTE: drop every cached decode whose bytes overlap the written one
+static void
+cpu_invalidate_decoded(struct cpu *cpu, u32 address) {
+    u32 offset = address - (cpu->instructions - cpu->memory);
+    if (!cpu->decoded || offset >= cpu->nbytes) {
+        return;
     }
+    for (int ip = offset; ip >= 0 && ip > (int)offset - OP_MAX_SIZE; ip--) {
+        cpu->decoded[ip].size = 0;
+    }
+    if (cpu->blocks) {
+        // NOTE: flushed between blocks, the running one finishes as decoded
+        cpu->blocks_stale = true;
+    }
+}
 
-    const char *bin_path = argv[1];
-    struct buffer asm_data = load_file(bin_path);
-    dbg(asm_data);
+// NOTE: physical addresses wrap at 1 MiB like on a real 8086
+static inline u32
+physical_address(u16 segment, u16 offset) {
+    return (((u32)segment << 4) + offset) & MEMORY_MASK;
+}
 
-    if (cpu.powered) {
-        printf("--- %s execution ---\n", bin_path);
-    } else {
-        printf("; %s\n", bin_path);
-        printf("\n");
-        printf("bits 16\n");
+static inline u8
+cpu_read_byte(struct cpu *cpu, u32 address) {
+    return cpu->memory[address & MEMORY_MASK];
+}
+
+static inline u16
+cpu_read_word(struct cpu *cpu, u32 address) {
+    return cpu->memory[address & MEMORY_MASK] | (cpu->memory[(address + 1) & MEMORY_MASK] << 8);
+}
+
+static inline void
+cpu_mark_dirty(struct cpu *cpu, u32 address) {
+    u32 page = (address & MEMORY_MASK) >> SNAPSHOT_PAGE_SHIFT;
+    cpu->dirty[page / 64] |= 1ull << (page % 64);
+}
+
+static void
+cpu_mark_dirty_range(struct cpu *cpu, u32 address, u32 size) {
+    for (u32 offset = 0; offset < size; offset += SNAPSHOT_PAGE_SIZE) {
+        cpu_mark_dirty(cpu, address + offset);
     }
+    if (size) {
+        cpu_mark_dirty(cpu, address + size - 1);
+    }
+}
+
+static inline void
+cpu_write_byte(struct cpu *cpu, u32 address, u8 value) {
+    cpu->memory[address & MEMORY_MASK] = value;
+    cpu_mark_dirty(cpu, address);
+    cpu_invalidate_decoded(cpu, address & MEMORY_MASK);
+}
+
+static inline void
+cpu_write_word(struct cpu *cpu, u32 address, u16 value) {
+    cpu_write_byte(cpu, address, value);
+    cpu_write_byte(cpu, address + 1, value >> 8);
+}
 
-    cpu_run(&cpu, asm_data);
-    printf("\n");
+static inline u16
+cpu_read_memory(struct cpu *cpu, u32 address, u8 w) {
+    if (cpu->profile.reads) {
+        cpu->profile.reads[address & MEMORY_MASK]++;
+    }
+    return (w) ? cpu_read_word(cpu, address) : cpu_read_byte(cpu, address);
+}
 
-    if (cpu.powered) {
-        cpu_print_regs(&cpu);
+static inline void
+cpu_write_memory(struct cpu *cpu, u32 address, u8 w, u16 value) {
+    if (cpu->profile.writes) {
+        cpu->profile.writes[address & MEMORY_MASK]++;
+    }
+    if (w) {
+        cpu_write_word(cpu, address, value);
+    } else {
+        cpu_write_byte(cpu, address, value);
     }
+}
 
-    free_buffer(&asm_data);
+// NOTE: al..bl are the low and ah..bh the high halves of ax..bx
+static inline u16
+cpu_read_reg(struct cpu *cpu, enum reg reg, u8 w) {
+    if (w) {
+        return cpu->regs[reg];
+    }
+    return (cpu->regs[reg & 0b11] >> ((reg & 0b100) << 1)) & 0xff;
 }
+
+static inline void
+cpu_write_reg(struct cpu *cpu, enum reg reg, u8 w, u16 value) {
+    if (w) {
+        cpu->regs[reg] = value;
+    } else {
+        u32 shift = (reg & 0b100) << 1;
+        cpu->regs[reg & 0b11] = (cpu->regs[reg & 0b11] & ~(0xff << shift)) | ((value & 0xff) << shift);
+    }
+}
+
+static enum sreg
+op_segment(struct op op, enum sreg default_segment) {
+    return (op.segment) ? op.segment - 1 : default_segment;
+}
+
+// NOTE: physical address of a memory operand, bp based modes default to ss
+static u32
+cpu_op_address(struct cpu *cpu, struct op op) {
+    bool bp_based = op.rm == 0b010 || op.rm == 0b011 || (op.rm == 0b110 && op.mod != 0b00);
+    enum sreg segment = op_segment(op, (bp_based) ? sreg_SS : sreg_DS);
+    return physical_address(cpu->sregs[segment], cpu_op_effective_address(cpu, op));
+}
+
+static u16
+cpu_read_rm(struct cpu *cpu, struct op op) {
+    if (op.mod == 0b11) {
+        return cpu_read_reg(cpu, op.rm, op.w);
+    }
+    return cpu_read_memory(cpu, cpu_op_address(cpu, op), op.w);
+}
+
+static void
+cpu_write_rm(struct cpu *cpu, struct op op, u16 value) {
+    if (op.mod == 0b11) {
+        cpu_write_reg(cpu, op.rm, op.w, value);
+    } else {
+        cpu_write_memory(cpu, cpu_op_address(cpu, op), op.w, value);
+    }
+}
+
+static void
+exec_mov_imm_to_rm(struct cpu *cpu, struct op op) {
+    cpu_write_rm(cpu, op, op.data);
+}
+
+static void
+exec_mov_imm_to_reg(struct cpu *cpu, struct op op) {
+    cpu_write_reg(cpu, op.reg, op.w, op.data);
+}
+
+static void
+exec_mov_rm_to_reg(struct cpu *cpu, struct op op) {
+    if (op.d) {
+        cpu_write_reg(cpu, op.reg, op.w, cpu_read_rm(cpu, op));
+    } else {
+        cpu_write_rm(cpu, op, cpu_read_reg(cpu, op.reg, op.w));
+    }
+}
+
+static void
+exec_mov_mem_to_acc(struct cpu *cpu, struct op op) {
+    u32 address = physical_address(cpu->sregs[op_segment(op, sreg_DS)], op.addr);
+    cpu_write_reg(cpu, reg_AX, op.w, cpu_read_memory(cpu, address, op.w));
+}
+
+static void
+exec_mov_acc_to_mem(struct cpu *cpu, struct op op) {
+    u32 address = physical_address(cpu->sregs[op_segment(op, sreg_DS)], op.addr);
+    cpu_write_memory(cpu, address, op.w, cpu_read_reg(cpu, reg_AX, op.w));
+}
+
+static void
+exec_mov_rm_to_sreg(struct cpu *cpu, struct op op) {
+    enum sreg sreg = op.reg & 0b11;
+    if (sreg == sreg_CS) {
+        // NOTE: code is fetched from the image at the load segment, every
+        // engine runs ops as last_ip = its start, so ip stays at the op
+        cpu->fault = "mov cs is not supported";
+        cpu->ip = cpu->last_ip;
+        return;
+    }
+    cpu->sregs[sreg] = cpu_read_rm(cpu, op);
+}
+
+static void
+exec_mov_sreg_to_rm(struct cpu *cpu, struct op op) {
+    cpu_write_rm(cpu, op, cpu->sregs[op.reg & 0b11]);
+}
+
+// NOTE: C/P/A/Z/S/O of an add or sub, result keeps the carry above the operand width
+static enum flags
+arith_flags(u16 a, u16 b, u32 result, bool sub, u8 w) {
+    u32 sign = (w) ? 0x8000 : 0x80;
+    enum flags flags = 0;
+
+    if (result & (sign << 1)) {
+        flags |= flags_CARRY;
+    }
+    // NOTE: parity of the low byte only, even if the op is a word op
+    if (!__builtin_parity(result & 0xff)) {
+        flags |= flags_PARITY;
+    }
+    if ((a ^ b ^ result) & 0x10) {
+        flags |= flags_AUX_CARRY;
+    }
+    if ((result & ((sign << 1) - 1)) == 0) {
+        flags |= flags_ZERO;
+    }
+    if (result & sign) {
+        flags |= flags_SIGN;
+    }
+    u16 same_signs = (sub) ? (a ^ b) : ~(a ^ b);
+    if (same_signs & (a ^ result) & sign) {
+        flags |= flags_OVERFLOW;
+    }
+
+    return flags;
+}
+
+// NOTE: materialize flags recorded by the last add/sub
+static enum flags
+cpu_flags(struct cpu *cpu) {
+    struct lazy_flags *lazy = &cpu->lazy;
+    if (lazy->op != lazy_NONE) {
+        cpu->flags = arith_flags(lazy->a, lazy->b, lazy->result, lazy->op == lazy_SUB, lazy->w);
+        lazy->op = lazy_NONE;
+    }
+    return cpu->flags;
+}
+
+static void
+cpu_set_flags(struct cpu *cpu, enum flags flags) {
+    cpu->lazy.op = lazy_NONE;
+    cpu->flags = flags;
+}
+
+static bool
+cpu_zero_flag(struct cpu *cpu) {
+    if (cpu->lazy.op != lazy_NONE) {
+        return (cpu->lazy.result & ((cpu->lazy.w) ? 0xffff : 0xff)) == 0;
+    }
+    return cpu->flags & flags_ZERO;
+}
+
+static u16
+cpu_arith(struct cpu *cpu, enum lazy_op kind, u16 a, u16 b, u8 w) {
+    u16 mask = (w) ? 0xffff : 0xff;
+    a &= mask;
+    b &= mask;
+    u32 result = (kind == lazy_SUB) ? (u32)a - b : (u32)a + b;
+    cpu->lazy = (struct lazy_flags){.op = kind, .a = a, .b = b, .result = result, .w = w};
+    return result;
+}
+
+// NOTE: add/sub/cmp between reg and r/m, d picks the destination
+static void
+cpu_arith_rm_reg(struct cpu *cpu, struct op op, enum lazy_op kind, bool store) {
+    u16 reg = cpu_read_reg(cpu, op.reg, op.w);
+    u16 rm = cpu_read_rm(cpu, op);
+    u16 result = (op.d) ? cpu_arith(cpu, kind, reg, rm, op.w) : cpu_arith(cpu, kind, rm, reg, op.w);
+    if (!store) {
+        return;
+    }
+    if (op.d) {
+        cpu_write_reg(cpu, op.reg, op.w, result);
+    } else {
+        cpu_write_rm(cpu, op, result);
+    }
+}
+
+static void
+cpu_arith_imm_to_rm(struct cpu *cpu, struct op op, enum lazy_op kind, bool store) {
+    u16 result = cpu_arith(cpu, kind, cpu_read_rm(cpu, op), op_immediate(op), op.w);
+    if (store) {
+        cpu_write_rm(cpu, op, result);
+    }
+}
+
+static void
+cpu_arith_imm_to_acc(struct cpu *cpu, struct op op, enum lazy_op kind, bool store) {
+    u16 result = cpu_arith(cpu, kind, cpu_read_reg(cpu, reg_AX, op.w), op.data, op.w);
+    if (store) {
+        cpu_write_reg(cpu, reg_AX, op.w, result);
+    }
+}
+
+static void
+exec_add(struct cpu *cpu, struct op op) {
+    cpu_arith_rm_reg(cpu, op, lazy_ADD, true);
+}
+
+static void
+exec_add_imm_to_rm(struct cpu *cpu, struct op op) {
+    cpu_arith_imm_to_rm(cpu, op, lazy_ADD, true);
+}
+
+static void
+exec_add_imm_to_acc(struct cpu *cpu, struct op op) {
+    cpu_arith_imm_to_acc(cpu, op, lazy_ADD, true);
+}
+
+static void
+exec_sub(struct cpu *cpu, struct op op) {
+    cpu_arith_rm_reg(cpu, op, lazy_SUB, true);
+}
+
+static void
+exec_sub_imm_to_rm(struct cpu *cpu, struct op op) {
+    cpu_arith_imm_to_rm(cpu, op, lazy_SUB, true);
+}
+
+static void
+exec_sub_imm_to_acc(struct cpu *cpu, struct op op) {
+    cpu_arith_imm_to_acc(cpu, op, lazy_SUB, true);
+}
+
+static void
+exec_cmp(struct cpu *cpu, struct op op) {
+    cpu_arith_rm_reg(cpu, op, lazy_SUB, false);
+}
+
+static void
+exec_cmp_imm_to_rm(struct cpu *cpu, struct op op) {
+    cpu_arith_imm_to_rm(cpu, op, lazy_SUB, false);
+}
+
+static void
+exec_cmp_imm_to_acc(struct cpu *cpu, struct op op) {
+    cpu_arith_imm_to_acc(cpu, op, lazy_SUB, false);
+}
+
+static void
+exec_jne(struct cpu *cpu, struct op op) {
+    if (!cpu_zero_flag(cpu)) {
+        cpu->ip = cpu->last_ip + op.ip_inc;
+    }
+}
+
+// NOTE: NULL - op is decoded but not simulated yet
+static const exec_proc exec_procs[op_num] = {
+    [op_MOV_IMM_TO_RM] = exec_mov_imm_to_rm,
+    [op_MOV_IMM_TO_REG] = exec_mov_imm_to_reg,
+    [op_MOV_RM_TO_REG] = exec_mov_rm_to_reg,
+    [op_MOV_MEM_TO_ACC] = exec_mov_mem_to_acc,
+    [op_MOV_ACC_TO_MEM] = exec_mov_acc_to_mem,
+    [op_MOV_RM_TO_SREG] = exec_mov_rm_to_sreg,
+    [op_MOV_SREG_TO_RM] = exec_mov_sreg_to_rm,
+    [op_ADD] = exec_add,
+    [op_ADD_IMM_TO_RM] = exec_add_imm_to_rm,
+    [op_ADD_IMM_TO_ACC] = exec_add_imm_to_acc,
+    [op_SUB] = exec_sub,
+    [op_SUB_IMM_TO_RM] = exec_sub_imm_to_rm,
+    [op_SUB_IMM_TO_ACC] = exec_sub_imm_to_acc,
+    [op_CMP] = exec_cmp,
+    [op_CMP_IMM_TO_RM] = exec_cmp_imm_to_rm,
+    [op_CMP_IMM_TO_ACC] = exec_cmp_imm_to_acc,
+    [op_JNE] = exec_jne,
+};
+
+static bool
+op_is_jump(enum op_type type) {
+    return type >= op_JE && type <= op_JCXZ;
+}
+
+#ifndef C8086_LIBRARY
+static const char *op_type_names[op_num] = {
+    [op_UNKNOWN] = "unknown",
+    [op_MOV_RM_TO_REG] = "mov r/m, reg",
+    [op_MOV_IMM_TO_RM] = "mov r/m, imm",
+    [op_MOV_IMM_TO_REG] = "mov reg, imm",
+    [op_MOV_MEM_TO_ACC] = "mov acc, mem",
+    [op_MOV_ACC_TO_MEM] = "mov mem, acc",
+    [op_MOV_RM_TO_SREG] = "mov sreg, r/m",
+    [op_MOV_SREG_TO_RM] = "mov r/m, sreg",
+    [op_ADD] = "add r/m, reg",
+    [op_ADD_IMM_TO_RM] = "add r/m, imm",
+    [op_ADD_IMM_TO_ACC] = "add acc, imm",
+    [op_SUB] = "sub r/m, reg",
+    [op_SUB_IMM_TO_RM] = "sub r/m, imm",
+    [op_SUB_IMM_TO_ACC] = "sub acc, imm",
+    [op_CMP] = "cmp r/m, reg",
+    [op_CMP_IMM_TO_RM] = "cmp r/m, imm",
+    [op_CMP_IMM_TO_ACC] = "cmp acc, imm",
+    [op_JE] = "je",
+    [op_JL] = "jl",
+    [op_JLE] = "jle",
+    [op_JB] = "jb",
+    [op_JBE] = "jbe",
+    [op_JP] = "jp",
+    [op_JO] = "jo",
+    [op_JS] = "js",
+    [op_JNE] = "jne",
+    [op_JNL] = "jnl",
+    [op_JG] = "jg",
+    [op_JNB] = "jnb",
+    [op_JA] = "ja",
+    [op_JNP] = "jnp",
+    [op_JNO] = "jno",
+    [op_JNS] = "jns",
+    [op_LOOP] = "loop",
+    [op_LOOPZ] = "loopz",
+    [op_LOOPNZ] = "loopnz",
+    [op_JCXZ] = "jcxz",
+};
+
+static void
+profile_init(struct profile *profile, u32 nbytes) {
+    *profile = (struct profile){
+        .ip_counts = calloc(nbytes, sizeof(*profile->ip_counts)),
+        .taken = calloc(nbytes, sizeof(*profile->taken)),
+        .not_taken = calloc(nbytes, sizeof(*profile->not_taken)),
+        .reads = calloc(MEMORY_MASK + 1, sizeof(*profile->reads)),
+        .writes = calloc(MEMORY_MASK + 1, sizeof(*profile->writes)),
+    };
+    assert(profile->ip_counts && profile->taken && profile->not_taken);
+    assert(profile->reads && profile->writes);
+}
+
+static void
+profile_free(struct profile *profile) {
+    free(profile->ip_counts);
+    free(profile->taken);
+    free(profile->not_taken);
+    free(profile->reads);
+    free(profile->writes);
+    *profile = (struct profile){};
+}
+#endif
+
+static void
+profile_op(struct profile *profile, struct op op, u16 ip, bool taken, u64 cycles) {
+    profile->ip_counts[ip]++;
+    profile->op_counts[op.type]++;
+    profile->op_cycles[op.type] += cycles;
+    if (op_is_jump(op.type)) {
+        if (taken) {
+            profile->taken[ip]++;
+        } else {
+            profile->not_taken[ip]++;
+        }
+    }
+}
+
+// NOTE: clocks from the 8086 family user's manual, ea clocks by mod/rm
+// as in cpu_op_effective_address, a segment override adds 2
+static u16
+op_ea_clocks(struct op op) {
+    if (op.mod == 0b00 && op.rm == 0b110) {
+        return 6 + ((op.segment) ? 2 : 0);
+    }
+
+    static const u16 rm_clocks[8] = {
+        [0b000] = 7, // bx + si
+        [0b001] = 8, // bx + di
+        [0b010] = 8, // bp + si
+        [0b011] = 7, // bp + di
+        [0b100] = 5, // si
+        [0b101] = 5, // di
+        [0b110] = 5, // bp
+        [0b111] = 5, // bx
+    };
+    u16 result = rm_clocks[op.rm];
+    if (op.mod == 0b01 || op.mod == 0b10) {
+        result += 4;
+    }
+    if (op.segment) {
+        result += 2;
+    }
+    return result;
+}
+
+// NOTE: base clocks, nmemory is set to the number of memory transfers
+static u16
+op_base_clocks(struct op op, bool taken, int *nmemory) {
+    bool memory = op.mod != 0b11;
+    *nmemory = 0;
+    switch (op.type) {
+    case op_MOV_RM_TO_REG:
+        *nmemory = memory;
+        return (!memory) ? 2 : (op.d) ? 8 : 9;
+    case op_MOV_IMM_TO_RM:
+        *nmemory = memory;
+        return (memory) ? 10 : 4;
+    case op_MOV_IMM_TO_REG:
+        return 4;
+    case op_MOV_MEM_TO_ACC:
+    case op_MOV_ACC_TO_MEM:
+        *nmemory = 1;
+        return 10;
+    case op_MOV_RM_TO_SREG:
+        *nmemory = memory;
+        return (memory) ? 8 : 2;
+    case op_MOV_SREG_TO_RM:
+        *nmemory = memory;
+        return (memory) ? 9 : 2;
+
+    case op_ADD:
+    case op_SUB:
+        // NOTE: a memory destination is read and written back
+        *nmemory = (!memory) ? 0 : (op.d) ? 1 : 2;
+        return (!memory) ? 3 : (op.d) ? 9 : 16;
+    case op_ADD_IMM_TO_RM:
+    case op_SUB_IMM_TO_RM:
+        *nmemory = (memory) ? 2 : 0;
+        return (memory) ? 17 : 4;
+    case op_CMP:
+        *nmemory = memory;
+        return (memory) ? 9 : 3;
+    case op_CMP_IMM_TO_RM:
+        *nmemory = memory;
+        return (memory) ? 10 : 4;
+    case op_ADD_IMM_TO_ACC:
+    case op_SUB_IMM_TO_ACC:
+    case op_CMP_IMM_TO_ACC:
+        return 4;
+
+    case op_LOOP: return (taken) ? 17 : 5;
+    case op_LOOPZ: return (taken) ? 18 : 6;
+    case op_LOOPNZ: return (taken) ? 19 : 5;
+    case op_JCXZ: return (taken) ? 18 : 6;
+    case op_JE ... op_JNS: return (taken) ? 16 : 4;
+
+    default: unreachable();
+    }
+    return 0;
+}
+
+// NOTE: called before the op executes, so the address is the one it uses;
+// the 8088 moves a word as two bytes, the 8086 only when it is unaligned
+static struct clocks
+cpu_op_clocks(struct cpu *cpu, struct op op, bool taken) {
+    int nmemory;
+    struct clocks result = {
+        .base = op_base_clocks(op, taken, &nmemory),
+    };
+    if (!nmemory) {
+        return result;
+    }
+
+    // NOTE: the accumulator forms have a direct address and no ea calculation
+    bool direct = op.type == op_MOV_MEM_TO_ACC || op.type == op_MOV_ACC_TO_MEM;
+    if (!direct) {
+        result.ea = op_ea_clocks(op);
+    }
+    u16 address = (direct) ? op.addr : cpu_op_effective_address(cpu, op);
+    if (op.w && (cpu->bus_8088 || (address & 1))) {
+        result.penalty = 4 * nmemory;
+    }
+    return result;
+}
+
+static void
+cpu_exec(struct cpu *cpu, struct op op) {
+    struct trace_record record = {
+        .kind = trace_OP,
+        .ip = cpu->last_ip,
+        .size = cpu->ip - cpu->last_ip,
+    };
+    memcpy(record.bytes, cpu->instructions + cpu->last_ip, record.size);
+    for (int i = 0; i < reg_num; i++) {
+        record.old_regs[i] = cpu->regs[i];
+    }
+    memcpy(record.old_sregs, cpu->sregs, sizeof(cpu->sregs));
+    record.old_flags = cpu_flags(cpu);
+
+    exec_proc proc = exec_procs[op.type];
+    bool profiling = cpu->profile.ip_counts != NULL;
+    u64 cycles = 0;
+    if (proc) {
+        if (cpu->clocks) {
+            record.clocks = cpu_op_clocks(cpu, op, false);
+        }
+        u64 started = (profiling) ? rdtsc() : 0;
+        proc(cpu, op);
+        if (profiling) {
+            cycles = rdtsc() - started;
+        }
+        bool taken = op_is_jump(op.type) && cpu->ip != record.ip + record.size;
+        if (cpu->clocks) {
+            if (taken) {
+                record.clocks = cpu_op_clocks(cpu, op, true);
+            }
+            cpu->total_clocks += record.clocks.base + record.clocks.ea + record.clocks.penalty;
+            record.total_clocks = cpu->total_clocks;
+        }
+        if (profiling) {
+            profile_op(&cpu->profile, op, record.ip, taken, cycles);
+        }
+    } else {
+        record.kind = trace_SKIPPED_OP;
+        if (profiling) {
+            profile_op(&cpu->profile, op, record.ip, false, 0);
+        }
+    }
+
+    for (int i = 0; i < reg_num; i++) {
+        record.new_regs[i] = cpu->regs[i];
+    }
+    memcpy(record.new_sregs, cpu->sregs, sizeof(cpu->sregs));
+    record.next_ip = cpu->ip;
+    cpu->last_ip = cpu->ip;
+    record.new_flags = cpu_flags(cpu);
+
+    if (cpu->binary_trace.out) {
+        trace_binary_record(&cpu->binary_trace, &record);
+    } else if (cpu->trace.out || cpu->trace.write) {
+        trace_text_record(&cpu->trace, &record, op, cpu->print_ip);
+    }
+}
+
+static void
+cpu_print_and_exec(struct cpu *cpu, struct op op) {
+#if DEBUG
+    dbg(op);
+#endif
+    if (cpu->powered) {
+        cpu_exec(cpu, op);
+    } else {
+        print_op(&cpu->trace, op);
+        trace_char(&cpu->trace, '\n');
+    }
+}
+
+static void
+prog_push(struct prog *prog, struct op op) {
+    struct prog_chunk *chunk = prog->last;
+    if (!chunk || chunk->nops == PROG_CHUNK_OPS) {
+        chunk = malloc(sizeof(*chunk));
+        assert(chunk);
+        chunk->next = NULL;
+        chunk->nops = 0;
+        if (prog->last) {
+            prog->last->next = chunk;
+        } else {
+            prog->first = chunk;
+        }
+        prog->last = chunk;
+    }
+    chunk->ops[chunk->nops++] = op;
+    prog->nops++;
+}
+
+static void
+prog_free(struct prog *prog) {
+    for (struct prog_chunk *chunk = prog->first, *next; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    *prog = (struct prog){};
+}
+
+// NOTE: decode the op at ip, once per address while the decode cache is on
+static struct decoded
+cpu_decode_at(struct cpu *cpu, struct prog *prog, u16 ip) {
+    struct decoded *entry = (cpu->decoded) ? cpu->decoded + ip : NULL;
+    if (entry && entry->size) {
+        cpu->decode_hits++;
+        return *entry;
+    }
+
+    struct decoded result;
+    int size = decode_op(cpu->instructions + ip, cpu->nbytes - ip, &result.op);
+    if (size < 0) {
+        assert(!"Unsupported op");
+    }
+    assert(size > 0);
+    result.size = size;
+    cpu->decode_misses++;
+
+    if (entry) {
+        *entry = result;
+    }
+
+    prog_push(prog, result.op);
+
+    return result;
+}
+
+static struct op
+cpu_decode_next(struct cpu *cpu, struct prog *prog) {
+    struct decoded decoded = cpu_decode_at(cpu, prog, cpu->ip);
+    cpu->ip += decoded.size;
+    return decoded.op;
+}
+
+static void
+exec_nop(struct cpu *cpu, struct op op) {
+}
+
+// NOTE: every op with a memory destination, those can patch the code ahead
+static bool
+op_writes_memory(struct op op) {
+    switch (op.type) {
+    case op_MOV_ACC_TO_MEM:
+        return true;
+    case op_MOV_IMM_TO_RM:
+    case op_MOV_SREG_TO_RM:
+    case op_ADD_IMM_TO_RM:
+    case op_SUB_IMM_TO_RM:
+        return op.mod != 0b11;
+    case op_MOV_RM_TO_REG:
+    case op_ADD:
+    case op_SUB:
+        return !op.d && op.mod != 0b11;
+    default:
+        return false;
+    }
+}
+
+// NOTE: ops that can stop the run with cpu->fault
+static bool
+op_can_fault(struct op op) {
+    return op.type == op_MOV_RM_TO_SREG && (op.reg & 0b11) == sreg_CS;
+}
+
+// NOTE: straight-line ops from ip up to and including the next jump, or an
+// op that can fault, which has to be last for its block to stop at it
+static struct block *
+cpu_compile_block(struct cpu *cpu, struct prog *prog, u16 ip) {
+    struct block_op ops[256];
+    int nops = 0;
+    u16 start_ip = ip;
+    u16 last_ip = ip;
+    bool writes_memory = false;
+
+    while (ip < cpu->nbytes && nops < len(ops)) {
+        struct decoded decoded = cpu_decode_at(cpu, prog, ip);
+        exec_proc proc = exec_procs[decoded.op.type];
+        last_ip = ip;
+        ip += decoded.size;
+        ops[nops++] = (struct block_op){
+            .proc = (proc) ? proc : exec_nop,
+            .op = decoded.op,
+            .next_ip = ip,
+        };
+        writes_memory |= op_writes_memory(decoded.op);
+        if (op_is_jump(decoded.op.type) || op_can_fault(decoded.op)) {
+            break;
+        }
+    }
+
+    struct block *result = calloc(1, sizeof(*result) + nops * sizeof(ops[0]));
+    assert(result);
+    result->nops = nops;
+    result->ip = start_ip;
+    result->last_ip = last_ip;
+    result->end_ip = ip;
+    result->writes_memory = writes_memory;
+    memcpy(result->ops, ops, nops * sizeof(ops[0]));
+
+    return result;
+}
+
+static void
+cpu_flush_blocks(struct cpu *cpu) {
+    for (int ip = 0; ip < cpu->nbytes; ip++) {
+        free(cpu->blocks[ip]);
+        cpu->blocks[ip] = NULL;
+    }
+    cpu->blocks_stale = false;
+    cpu->jit.ncode = 0;
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+// NOTE: x86-64 JIT for hot blocks. Simulated registers live in r8..r15 in
+// reg order (ax = r8, ..., di = r15), rdi holds the cpu, rsi cpu->memory,
+// rbx counts loop iterations and rax is scratch. Native code returns the
+// host rflags, whose C/P/A/Z/S/O match the 8086 ones for 16-bit add/sub/cmp.
+
+_Static_assert(sizeof(((struct cpu *)0)->regs[0]) == 4, "jit loads registers as dwords");
+
+struct emitter {
+    u8 data[8192];
+    u32 size;
+};
+
+static void
+emit8(struct emitter *e, u8 byte) {
+    if (e->size < len(e->data)) {
+        e->data[e->size] = byte;
+    }
+    e->size++;
+}
+
+static void
+emit16(struct emitter *e, u16 value) {
+    emit8(e, value);
+    emit8(e, value >> 8);
+}
+
+static void
+emit32(struct emitter *e, u32 value) {
+    emit16(e, value);
+    emit16(e, value >> 16);
+}
+
+static void
+jit_store_ip(struct emitter *e, u16 ip) {
+    // NOTE: mov word [rdi + ip], imm16
+    emit8(e, 0x66); emit8(e, 0xc7); emit8(e, 0x87);
+    emit32(e, offsetof(struct cpu, ip));
+    emit16(e, ip);
+}
+
+// NOTE: bts the dirty bits of the pages of the word at eax, like
+// cpu_mark_dirty does for each byte; bts clobbers host flags, so they are
+// pushed around it
+static void
+jit_mark_dirty(struct emitter *e) {
+    // NOTE: pushfq; mov ecx, eax
+    emit8(e, 0x9c);
+    emit8(e, 0x89); emit8(e, 0xc1);
+    for (int byte = 0; byte < 2; byte++) {
+        if (byte) {
+            // NOTE: lea ecx, [rax + 1]
+            emit8(e, 0x8d); emit8(e, 0x48); emit8(e, 0x01);
+        }
+        // NOTE: shr ecx, SNAPSHOT_PAGE_SHIFT; bts [rdi + dirty], ecx
+        emit8(e, 0xc1); emit8(e, 0xe9); emit8(e, SNAPSHOT_PAGE_SHIFT);
+        emit8(e, 0x0f); emit8(e, 0xab); emit8(e, 0x8f);
+        emit32(e, offsetof(struct cpu, dirty));
+    }
+    // NOTE: popfq
+    emit8(e, 0x9d);
+}
+
+// NOTE: eax = physical address of a memory operand, computed with lea so
+// host flags survive. There is no wrap at 1 MiB and no code invalidation,
+// jit_segments_ok checks the segments the block uses before each run.
+// Stores mark their pages dirty here, the word is written right after
+static void
+jit_address(struct emitter *e, struct op op, struct block *block, bool store) {
+    static const enum reg bases[8] = {reg_BX, reg_BX, reg_BP, reg_BP, reg_SI, reg_DI, reg_BP, reg_BX};
+    static const enum reg indices[8] = {reg_SI, reg_DI, reg_SI, reg_DI};
+
+    bool bp_based = op.rm == 0b010 || op.rm == 0b011 || (op.rm == 0b110 && op.mod != 0b00);
+    enum sreg segment = op_segment(op, (bp_based) ? sreg_SS : sreg_DS);
+    if (store) {
+        block->store_segments |= 1 << segment;
+    } else {
+        block->load_segments |= 1 << segment;
+    }
+
+    if (op.mod == 0b00 && op.rm == 0b110) {
+        // NOTE: mov eax, imm32
+        emit8(e, 0xb8);
+        emit32(e, (u16)op.addr);
+    } else {
+        int disp = (op.mod == 0b00) ? 0 : op.disp;
+        enum reg base = bases[op.rm];
+        if (op.rm < 0b100) {
+            // NOTE: lea eax, [base + index + disp32]
+            emit8(e, 0x43); emit8(e, 0x8d); emit8(e, 0x84);
+            emit8(e, (indices[op.rm] << 3) | base);
+        } else {
+            // NOTE: lea eax, [base + disp32]
+            emit8(e, 0x41); emit8(e, 0x8d); emit8(e, 0x80 | base);
+        }
+        emit32(e, disp);
+
+        // NOTE: movzx eax, ax
+        emit8(e, 0x0f); emit8(e, 0xb7); emit8(e, 0xc0);
+    }
+
+    // NOTE: movzx ecx, word [rdi + sregs[segment]]; eax += ecx * 16
+    emit8(e, 0x0f); emit8(e, 0xb7); emit8(e, 0x8f);
+    emit32(e, offsetof(struct cpu, sregs) + segment * sizeof(u16));
+    emit8(e, 0x8d); emit8(e, 0x04); emit8(e, 0xc8);
+    emit8(e, 0x8d); emit8(e, 0x04); emit8(e, 0xc8);
+    if (store) {
+        jit_mark_dirty(e);
+    }
+}
+
+// NOTE: op r/m16, r16 on host registers
+static void
+jit_reg_reg(struct emitter *e, u8 opcode, struct op op) {
+    enum reg dst = (op.d) ? op.reg : op.rm;
+    enum reg src = (op.d) ? op.rm : op.reg;
+    emit8(e, 0x66); emit8(e, 0x45); emit8(e, opcode);
+    emit8(e, 0xc0 | (src << 3) | dst);
+}
+
+// NOTE: op r16, imm16 from the 0x81 group
+static void
+jit_reg_imm(struct emitter *e, u8 ext, struct op op) {
+    emit8(e, 0x66); emit8(e, 0x41); emit8(e, 0x81);
+    emit8(e, 0xc0 | (ext << 3) | op.rm);
+    emit16(e, op_immediate(op));
+}
+
+static bool
+op_sets_flags(enum op_type type) {
+    switch (type) {
+    case op_ADD:
+    case op_ADD_IMM_TO_RM:
+    case op_SUB:
+    case op_SUB_IMM_TO_RM:
+    case op_CMP:
+    case op_CMP_IMM_TO_RM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// NOTE: false when the op has to stay in the interpreter
+static bool
+jit_op(struct emitter *e, struct op op, struct block *block) {
+    if (!op.w) {
+        return false;
+    }
+
+    switch (op.type) {
+    case op_MOV_IMM_TO_REG:
+    case op_MOV_IMM_TO_RM: {
+        if (op.type == op_MOV_IMM_TO_REG || op.mod == 0b11) {
+            // NOTE: mov r16, imm16
+            enum reg dst = (op.type == op_MOV_IMM_TO_REG) ? op.reg : op.rm;
+            emit8(e, 0x66); emit8(e, 0x41); emit8(e, 0xb8 + dst);
+        } else {
+            // NOTE: mov word [rsi + rax], imm16
+            jit_address(e, op, block, true);
+            emit8(e, 0x66); emit8(e, 0xc7); emit8(e, 0x04); emit8(e, 0x06);
+        }
+        emit16(e, op.data);
+    } break;
+    case op_MOV_RM_TO_REG: {
+        if (op.mod == 0b11) {
+            jit_reg_reg(e, 0x89, op);
+        } else if (op.d) {
+            // NOTE: movzx r32, word [rsi + rax]
+            jit_address(e, op, block, false);
+            emit8(e, 0x44); emit8(e, 0x0f); emit8(e, 0xb7);
+            emit8(e, (op.reg << 3) | 0b100); emit8(e, 0x06);
+        } else {
+            // NOTE: mov word [rsi + rax], r16
+            jit_address(e, op, block, true);
+            emit8(e, 0x66); emit8(e, 0x44); emit8(e, 0x89);
+            emit8(e, (op.reg << 3) | 0b100); emit8(e, 0x06);
+        }
+    } break;
+    case op_ADD:
+    case op_SUB:
+    case op_CMP: {
+        if (op.mod != 0b11) {
+            return false;
+        }
+        u8 opcode = (op.type == op_ADD) ? 0x01 : (op.type == op_SUB) ? 0x29 : 0x39;
+        jit_reg_reg(e, opcode, op);
+    } break;
+    case op_ADD_IMM_TO_RM:
+    case op_SUB_IMM_TO_RM:
+    case op_CMP_IMM_TO_RM: {
+        if (op.mod != 0b11) {
+            return false;
+        }
+        u8 ext = (op.type == op_ADD_IMM_TO_RM) ? 0b000 : (op.type == op_SUB_IMM_TO_RM) ? 0b101 : 0b111;
+        jit_reg_imm(e, ext, op);
+    } break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+// NOTE: native code reads and writes cpu->memory directly, so every segment
+// the block uses has to keep a word access inside it and stores off the code
+static bool
+jit_segments_ok(struct cpu *cpu, struct block *block) {
+    u32 code_start = cpu->instructions - cpu->memory;
+    u32 code_end = code_start + cpu->nbytes;
+    for (int i = 0; i < sreg_num; i++) {
+        u32 base = cpu->sregs[i] << 4;
+        u32 end = base + 0x10000 + 1;
+        if (((block->load_segments | block->store_segments) & (1 << i)) && end > sizeof(cpu->memory)) {
+            return false;
+        }
+        if ((block->store_segments & (1 << i)) && base < code_end && code_start < end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+jit_compile_block(struct cpu *cpu, struct block *block) {
+    block->no_jit = true;
+
+    struct emitter *e = malloc(sizeof(*e));
+    assert(e);
+    e->size = 0;
+
+    // NOTE: push rbx, r12..r15
+    emit8(e, 0x53);
+    for (int i = 4; i < 8; i++) {
+        emit8(e, 0x41); emit8(e, 0x50 + i);
+    }
+    // NOTE: mov r(8+i)d, [rdi + regs[i]]
+    for (int i = 0; i < reg_num; i++) {
+        emit8(e, 0x44); emit8(e, 0x8b); emit8(e, 0x80 | (i << 3) | 0b111);
+        emit32(e, offsetof(struct cpu, regs) + i * sizeof(cpu->regs[0]));
+    }
+    // NOTE: lea rsi, [rdi + memory]; xor ebx, ebx
+    emit8(e, 0x48); emit8(e, 0x8d); emit8(e, 0xb7);
+    emit32(e, offsetof(struct cpu, memory));
+    emit8(e, 0x31); emit8(e, 0xdb);
+
+    u32 top = e->size;
+    // NOTE: lea rbx, [rbx + 1]
+    emit8(e, 0x48); emit8(e, 0x8d); emit8(e, 0x5b); emit8(e, 0x01);
+
+    bool flags_known = false;
+    bool supported = true;
+    for (int i = 0; i < block->nops && supported; i++) {
+        struct op op = block->ops[i].op;
+        if (op.type == op_JNE && i == block->nops - 1) {
+            // NOTE: host flags must come from this block
+            supported = flags_known;
+            break;
+        }
+        supported = jit_op(e, op, block);
+        flags_known |= op_sets_flags(op.type);
+    }
+
+    struct op last = block->ops[block->nops - 1].op;
+    if (supported && last.type == op_JNE) {
+        u16 target = block->last_ip + last.ip_inc;
+        if (target == block->ip) {
+            // NOTE: jnz top
+            emit8(e, 0x0f); emit8(e, 0x85);
+            emit32(e, top - (e->size + 4));
+            jit_store_ip(e, block->end_ip);
+        } else {
+            // NOTE: jnz taken; store end_ip; jmp exit; taken: store target
+            emit8(e, 0x0f); emit8(e, 0x85); emit32(e, 9 + 2);
+            jit_store_ip(e, block->end_ip);
+            emit8(e, 0xeb); emit8(e, 9);
+            jit_store_ip(e, target);
+        }
+    } else {
+        jit_store_ip(e, block->end_ip);
+    }
+
+    // NOTE: mov [rdi + regs[i]], r(8+i)d
+    for (int i = 0; i < reg_num; i++) {
+        emit8(e, 0x44); emit8(e, 0x89); emit8(e, 0x80 | (i << 3) | 0b111);
+        emit32(e, offsetof(struct cpu, regs) + i * sizeof(cpu->regs[0]));
+    }
+    // NOTE: mov [rdi + jit.iterations], rbx; pushfq; pop rax
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0x9f);
+    emit32(e, offsetof(struct cpu, jit.iterations));
+    emit8(e, 0x9c); emit8(e, 0x58);
+    // NOTE: pop r15..r12, rbx; ret
+    for (int i = 7; i >= 4; i--) {
+        emit8(e, 0x41); emit8(e, 0x58 + i);
+    }
+    emit8(e, 0x5b);
+    emit8(e, 0xc3);
+
+    if (supported && e->size <= len(e->data) && cpu->jit.ncode + e->size <= cpu->jit.capacity) {
+        u8 *native = cpu->jit.code + cpu->jit.ncode;
+        memcpy(native, e->data, e->size);
+        cpu->jit.ncode += e->size;
+
+        block->native = (jit_proc)native;
+        block->sets_flags = flags_known;
+        block->no_jit = false;
+        cpu->jit.ncompiled++;
+    }
+
+    free(e);
+}
+
+// NOTE: the mapping outlives a run so short programs don't pay for mmap each time
+static _Thread_local struct {
+    u8 *code;
+    u32 capacity;
+} jit_buffer;
+
+static void
+jit_init(struct cpu *cpu) {
+    if (!jit_buffer.code) {
+        u32 capacity = 1024*1024;
+        void *code = mmap(NULL, capacity, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) {
+            cpu->jit.fallback = "Cannot map jit buffer";
+            cpu->use_jit = false;
+            return;
+        }
+        jit_buffer.code = code;
+        jit_buffer.capacity = capacity;
+    }
+    cpu->jit.code = jit_buffer.code;
+    cpu->jit.capacity = jit_buffer.capacity;
+    cpu->jit.ncode = 0;
+}
+
+static void
+jit_free(struct cpu *cpu) {
+    cpu->jit.code = NULL;
+    cpu->jit.capacity = 0;
+}
+
+static enum flags
+flags_from_host(u64 rflags) {
+    enum flags result = 0;
+    if (rflags & (1 << 0)) result |= flags_CARRY;
+    if (rflags & (1 << 2)) result |= flags_PARITY;
+    if (rflags & (1 << 4)) result |= flags_AUX_CARRY;
+    if (rflags & (1 << 6)) result |= flags_ZERO;
+    if (rflags & (1 << 7)) result |= flags_SIGN;
+    if (rflags & (1 << 11)) result |= flags_OVERFLOW;
+    return result;
+}
+
+#else
+
+static void
+jit_compile_block(struct cpu *cpu, struct block *block) {
+    block->no_jit = true;
+}
+
+static bool
+jit_segments_ok(struct cpu *cpu, struct block *block) {
+    return false;
+}
+
+static void
+jit_init(struct cpu *cpu) {
+    cpu->jit.fallback = "No jit for this host";
+    cpu->use_jit = false;
+}
+
+static void
+jit_free(struct cpu *cpu) {
+}
+
+static enum flags
+flags_from_host(u64 rflags) {
+    unreachable();
+    return 0;
+}
+
+#endif
+
+// NOTE: threaded code: run whole blocks of pre-resolved procs without tracing
+static void
+cpu_run_fast(struct cpu *cpu, struct prog *prog) {
+    cpu->blocks = calloc(cpu->nbytes, sizeof(*cpu->blocks));
+    assert(cpu->blocks);
+
+    while (cpu->ip < cpu->nbytes && !cpu->fault && (!cpu->stop_after || cpu->nexecuted < cpu->stop_after)) {
+        if (cpu->blocks_stale) {
+            cpu_flush_blocks(cpu);
+        }
+
+        struct block *block = cpu->blocks[cpu->ip];
+        if (!block) {
+            block = cpu->blocks[cpu->ip] = cpu_compile_block(cpu, prog, cpu->ip);
+        }
+
+        if (cpu->use_jit && !block->native && !block->no_jit && ++block->hits >= JIT_HOT_COUNT) {
+            if (!cpu->jit.code) {
+                jit_init(cpu);
+            }
+            if (cpu->jit.code) {
+                jit_compile_block(cpu, block);
+            }
+        }
+
+        if (block->native && jit_segments_ok(cpu, block)) {
+            // NOTE: native stores mark their own pages dirty, see jit_mark_dirty
+            u64 rflags = block->native(cpu);
+            if (block->sets_flags) {
+                cpu_set_flags(cpu, flags_from_host(rflags));
+            }
+            cpu->nexecuted += cpu->jit.iterations * block->nops;
+            continue;
+        }
+
+        // NOTE: only the final op can be a jump, which is relative to its own start
+        cpu->last_ip = block->last_ip;
+        cpu->ip = block->end_ip;
+        if (block->writes_memory) {
+            // NOTE: a store into code ends the block right after it
+            for (struct block_op *op = block->ops, *end = block->ops + block->nops; op < end; op++) {
+                op->proc(cpu, op->op);
+                cpu->nexecuted++;
+                if (cpu->blocks_stale) {
+                    cpu->ip = op->next_ip;
+                    break;
+                }
+            }
+            continue;
+        }
+        for (struct block_op *op = block->ops, *end = block->ops + block->nops; op < end; op++) {
+            op->proc(cpu, op->op);
+        }
+        cpu->nexecuted += block->nops;
+    }
+    cpu->last_ip = cpu->ip;
+
+    cpu_flush_blocks(cpu);
+    free(cpu->blocks);
+    cpu->blocks = NULL;
+    jit_free(cpu);
+}
+
+#ifndef C8086_LIBRARY
+// NOTE: copies only the dirty pages, so the cost follows what the run wrote
+static struct snapshot
+cpu_save_snapshot(struct cpu *cpu) {
+    struct snapshot result = {
+        .ip = cpu->ip,
+        .flags = cpu_flags(cpu),
+        .load_segment = cpu->load_segment,
+        .nbytes = cpu->nbytes,
+    };
+    for (int i = 0; i < reg_num; i++) {
+        result.regs[i] = cpu->regs[i];
+    }
+    memcpy(result.sregs, cpu->sregs, sizeof(result.sregs));
+
+    for (int i = 0; i < len(cpu->dirty); i++) {
+        result.npages += __builtin_popcountll(cpu->dirty[i]);
+    }
+    result.pages = malloc((result.npages ? result.npages : 1) * sizeof(*result.pages));
+    result.data = malloc((result.npages ? result.npages : 1) * SNAPSHOT_PAGE_SIZE);
+    assert(result.pages && result.data);
+
+    u32 n = 0;
+    for (int i = 0; i < len(cpu->dirty); i++) {
+        for (u64 bits = cpu->dirty[i]; bits; bits &= bits - 1) {
+            u32 page = i * 64 + __builtin_ctzll(bits);
+            result.pages[n] = page;
+            memcpy(result.data + n * SNAPSHOT_PAGE_SIZE, cpu->memory + (page << SNAPSHOT_PAGE_SHIFT), SNAPSHOT_PAGE_SIZE);
+            n++;
+        }
+    }
+    return result;
+}
+#endif
+
+// NOTE: clears the pages this cpu dirtied and copies in the snapshot pages,
+// forking many runs off one snapshot never touches the untouched memory
+static void
+cpu_restore_snapshot(struct cpu *cpu, const struct snapshot *snapshot) {
+    for (int i = 0; i < len(cpu->dirty); i++) {
+        for (u64 bits = cpu->dirty[i]; bits; bits &= bits - 1) {
+            u32 page = i * 64 + __builtin_ctzll(bits);
+            memset(cpu->memory + (page << SNAPSHOT_PAGE_SHIFT), 0, SNAPSHOT_PAGE_SIZE);
+        }
+        cpu->dirty[i] = 0;
+    }
+    for (u32 i = 0; i < snapshot->npages; i++) {
+        u32 page = snapshot->pages[i];
+        memcpy(cpu->memory + (page << SNAPSHOT_PAGE_SHIFT), snapshot->data + i * SNAPSHOT_PAGE_SIZE, SNAPSHOT_PAGE_SIZE);
+        cpu->dirty[page / 64] |= 1ull << (page % 64);
+    }
+
+    for (int i = 0; i < reg_num; i++) {
+        cpu->regs[i] = snapshot->regs[i];
+    }
+    memcpy(cpu->sregs, snapshot->sregs, sizeof(cpu->sregs));
+    cpu->ip = cpu->last_ip = snapshot->ip;
+    cpu_set_flags(cpu, snapshot->flags);
+    cpu->load_segment = snapshot->load_segment;
+    cpu->nbytes = snapshot->nbytes;
+    cpu->resumed = true;
+}
+
+#ifndef C8086_LIBRARY
+static void
+snapshot_free(struct snapshot *snapshot) {
+    free(snapshot->pages);
+    free(snapshot->data);
+    *snapshot = (struct snapshot){};
+}
+#endif
+
+// NOTE: ip is a u16, an image that fills the whole code segment leaves
+// ip < nbytes true forever and would never halt
+static bool
+cpu_image_fits(const struct cpu *cpu, u32 ndata) {
+    return ndata < 0x10000 && (cpu->load_segment << 4) + ndata <= sizeof(cpu->memory);
+}
+
+static void
+cpu_load_image(struct cpu *cpu, const void *data, u32 ndata) {
+    u32 load_address = cpu->load_segment << 4;
+    assert(cpu_image_fits(cpu, ndata));
+    memcpy(cpu->memory + load_address, data, ndata);
+    cpu_mark_dirty_range(cpu, load_address, ndata);
+    cpu->sregs[sreg_CS] = cpu->load_segment;
+    cpu->nbytes = ndata;
+    cpu->instructions = cpu->memory + load_address;
+}
+
+static void
+stops_add_breakpoint(struct stops *stops, u16 ip) {
+    u64 bit = 1ull << (ip % 64);
+    if (!(stops->breakpoints[ip / 64] & bit)) {
+        stops->breakpoints[ip / 64] |= bit;
+        stops->nbreakpoints++;
+    }
+}
+
+static void
+stops_remove_breakpoint(struct stops *stops, u16 ip) {
+    u64 bit = 1ull << (ip % 64);
+    if (stops->breakpoints[ip / 64] & bit) {
+        stops->breakpoints[ip / 64] &= ~bit;
+        stops->nbreakpoints--;
+    }
+}
+
+#ifndef C8086_LIBRARY
+static bool
+stops_any(const struct stops *stops) {
+    return stops->nbreakpoints || stops->nwatchpoints || stops->nconditions;
+}
+#endif
+
+static bool
+cpu_condition_holds(struct cpu *cpu, const struct condition *condition) {
+    return (cpu->regs[condition->reg] == condition->value) != condition->not_equal;
+}
+
+static void
+cpu_read_watched(struct cpu *cpu, const struct watchpoint *watchpoint, u8 *out) {
+    for (u32 i = 0; i < watchpoint->size; i++) {
+        out[i] = cpu->memory[(watchpoint->address + i) & MEMORY_MASK];
+    }
+}
+
+// NOTE: the interpreter loop with the stop checks, cpu_run only takes it when
+// a stop is set, so the plain loop has no extra test per op. The first op
+// never hits a breakpoint, a run resumed at one moves on. Watchpoints compare
+// the watched bytes after every op instead of hooking the memory writes, and
+// conditions stop when they turn true, not while they stay true
+static enum stop_reason
+cpu_run_checked(struct cpu *cpu, struct prog *prog, u64 count) {
+    struct stops *stops = &cpu->stops;
+    bool held[MAX_CONDITIONS];
+    for (u32 i = 0; i < stops->nconditions; i++) {
+        held[i] = cpu_condition_holds(cpu, &stops->conditions[i]);
+    }
+    for (u32 i = 0; i < stops->nwatchpoints; i++) {
+        cpu_read_watched(cpu, &stops->watchpoints[i], stops->watchpoints[i].old);
+    }
+
+    stops->reason = stop_NONE;
+    for (u64 n = 0; (!count || n < count) && cpu->ip < cpu->nbytes && !cpu->fault; n++) {
+        if (cpu->stop_after && cpu->nexecuted >= cpu->stop_after) {
+            break;
+        }
+        if (n && (stops->breakpoints[cpu->ip / 64] >> (cpu->ip % 64)) & 1) {
+            stops->reason = stop_BREAKPOINT;
+            break;
+        }
+
+        struct op op = cpu_decode_next(cpu, prog);
+        cpu_print_and_exec(cpu, op);
+        cpu->nexecuted++;
+
+        for (u32 i = 0; i < stops->nwatchpoints && !stops->reason; i++) {
+            struct watchpoint *watchpoint = &stops->watchpoints[i];
+            u8 now[WATCHPOINT_MAX_SIZE];
+            cpu_read_watched(cpu, watchpoint, now);
+            if (memcmp(now, watchpoint->old, watchpoint->size) != 0) {
+                memcpy(watchpoint->old, now, watchpoint->size);
+                stops->reason = stop_WATCHPOINT;
+                stops->which = i;
+            }
+        }
+        for (u32 i = 0; i < stops->nconditions; i++) {
+            bool holds = cpu_condition_holds(cpu, &stops->conditions[i]);
+            if (holds && !held[i] && !stops->reason) {
+                stops->reason = stop_CONDITION;
+                stops->which = i;
+            }
+            held[i] = holds;
+        }
+        if (stops->reason) {
+            break;
+        }
+    }
+    return stops->reason;
+}
+
+#ifndef C8086_LIBRARY
+static void
+cpu_print_stop(struct cpu *cpu) {
+    const struct stops *stops = &cpu->stops;
+    struct trace *t = &cpu->trace;
+    trace_str(t, "Stopped at ");
+    trace_hex(t, cpu->ip, 4);
+    trace_str(t, ": ");
+    switch (stops->reason) {
+    case stop_BREAKPOINT: trace_str(t, "breakpoint"); break;
+    case stop_WATCHPOINT: {
+        const struct watchpoint *watchpoint = &stops->watchpoints[stops->which];
+        trace_str(t, "watchpoint ");
+        trace_hex(t, watchpoint->address, 5);
+        trace_char(t, ':');
+        trace_int(t, watchpoint->size, false);
+        trace_str(t, " changed");
+    } break;
+    case stop_CONDITION: {
+        const struct condition *condition = &stops->conditions[stops->which];
+        trace_str(t, reg_name(condition->reg, 1));
+        trace_str(t, (condition->not_equal) ? "!=" : "==");
+        trace_int(t, condition->value, false);
+    } break;
+    case stop_NONE: unreachable();
+    }
+    trace_char(t, '\n');
+}
+
+static struct prog
+cpu_run(struct cpu *cpu, struct buffer asm_data) {
+    struct prog result = {};
+
+    if (!cpu->powered) {
+        // NOTE: disassembly reads the mapped image directly, past 64 KiB too
+        for (u32 pos = 0; pos < asm_data.ndata; ) {
+            struct op op;
+            int size = decode_op(asm_data.data + pos, asm_data.ndata - pos, &op);
+            if (size < 0) {
+                assert(!"Unsupported op");
+            }
+            assert(size > 0);
+            prog_push(&result, op);
+            cpu_print_and_exec(cpu, op);
+            pos += size;
+        }
+        return result;
+    }
+
+    // NOTE: code runs out of simulated memory, so stores into it are seen;
+    // without segments ip only reaches the first 64 KiB of the image
+    if (!cpu->resumed) {
+        cpu_load_image(cpu, asm_data.data, asm_data.ndata);
+    }
+    cpu->instructions = cpu->memory + (cpu->load_segment << 4);
+    if (cpu->memory_diff) {
+        cpu->memory_baseline = cpu_save_snapshot(cpu);
+    }
+
+    cpu->decoded = calloc(cpu->nbytes, sizeof(*cpu->decoded));
+    assert(cpu->decoded);
+    if (cpu->profiling) {
+        profile_init(&cpu->profile, cpu->nbytes);
+    }
+
+    if (cpu->fast) {
+        cpu_run_fast(cpu, &result);
+    } else if (stops_any(&cpu->stops)) {
+        cpu_run_checked(cpu, &result, 0);
+    } else {
+        while (cpu->ip < cpu->nbytes && !cpu->fault && (!cpu->stop_after || cpu->nexecuted < cpu->stop_after)) {
+            struct op op = cpu_decode_next(cpu, &result);
+            cpu_print_and_exec(cpu, op);
+            cpu->nexecuted++;
+        }
+    }
+
+    free(cpu->decoded);
+    cpu->decoded = NULL;
+
+    return result;
+}
+
+static u64
+xorshift64(u64 *state) {
+    u64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// NOTE: decode the whole image over and over without executing or printing
+static void
+bench_decode(const char *path, struct buffer asm_data) {
+    u32 nreps = (64 << 20) / (asm_data.ndata ? asm_data.ndata : 1) + 1;
+    u64 nops = 0;
+    u64 checksum = 0;
+
+    u64 started = now();
+    for (u32 rep = 0; rep < nreps; rep++) {
+        for (u32 pos = 0; pos < asm_data.ndata; ) {
+            struct op op;
+            int size = decode_op(asm_data.data + pos, asm_data.ndata - pos, &op);
+            assert(size > 0);
+            checksum += op.type + op.data;
+            pos += size;
+            nops++;
+        }
+    }
+    u64 elapsed = now() - started;
+
+    f64 seconds = (f64)elapsed / Seconds;
+    f64 nbytes = (f64)asm_data.ndata * nreps;
+    printf("%s: %lu ops in %.3fs: %.1f Mops/s, %.1f MB/s (checksum %lu)\n",
+           path, nops, seconds, nops / seconds / 1e6, nbytes / seconds / 1e6, checksum);
+}
+
+// NOTE: simulated MIPS of every engine, the trace goes to /dev/null
+static void
+bench_exec(const char *path, struct buffer asm_data) {
+    struct {
+        const char *name;
+        bool fast;
+        bool use_jit;
+    } engines[] = {
+        {"exec", false, false},
+        {"exec-fast", true, false},
+        {"exec-jit", true, true},
+    };
+
+    struct cpu *cpu = malloc(sizeof(*cpu));
+    assert(cpu);
+    FILE *null = fopen("/dev/null", "w");
+    assert(null);
+
+    for (int i = 0; i < len(engines); i++) {
+        u64 nexecuted = 0;
+        u64 elapsed = 0;
+        while (elapsed < 250 * Milliseconds) {
+            memset(cpu, 0, sizeof(*cpu));
+            cpu->powered = true;
+            cpu->fast = engines[i].fast;
+            cpu->use_jit = engines[i].use_jit;
+            cpu->trace.out = null;
+
+            u64 started = now();
+            struct prog prog = cpu_run(cpu, asm_data);
+            prog_free(&prog);
+            trace_close(&cpu->trace);
+            elapsed += now() - started;
+            nexecuted += cpu->nexecuted;
+        }
+
+        f64 seconds = (f64)elapsed / Seconds;
+        printf("%s: %-9s %12lu ops in %.3fs: %8.2f MIPS\n", path, engines[i].name, nexecuted, seconds, nexecuted / seconds / 1e6);
+    }
+
+    fclose(null);
+    free(cpu);
+}
+
+// NOTE: the kernels as they were before the table and popcount versions,
+// kept as the baseline of -bench-kernels and to check the new ones against
+static bool
+parity_loop(u32 result) {
+    int parity = 0;
+    for (int i = 0; i < 8; i++) {
+        if ((result >> i) & 0x1) {
+            parity++;
+        }
+    }
+    return !(parity & 0x1);
+}
+
+static u16
+effective_address_switch(struct cpu *cpu, struct op op) {
+    u16 address = 0;
+    switch (op.rm) {
+    case 0b000: address = cpu->regs[reg_BX] + cpu->regs[reg_SI]; break;
+    case 0b001: address = cpu->regs[reg_BX] + cpu->regs[reg_DI]; break;
+    case 0b010: address = cpu->regs[reg_BP] + cpu->regs[reg_SI]; break;
+    case 0b011: address = cpu->regs[reg_BP] + cpu->regs[reg_DI]; break;
+    case 0b100: address = cpu->regs[reg_SI]; break;
+    case 0b101: address = cpu->regs[reg_DI]; break;
+    case 0b110: address = (op.mod == 0b00) ? op.addr : cpu->regs[reg_BP]; break;
+    case 0b111: address = cpu->regs[reg_BX]; break;
+    default: unreachable();
+    }
+    if ((op.mod == 0b01) || (op.mod == 0b10)) {
+        address += (op.mod == 0b10) ? op.disp : op.disp_byte;
+    }
+    return address;
+}
+
+#define BENCH_KERNEL_BATCH 4096
+
+// NOTE: ns per call of the parity and effective-address kernels, old and new,
+// against ns per op of -exec on the image. Memory operands come from the image
+// when it has any, registers and results are random
+static void
+bench_kernels(const char *path, struct buffer asm_data) {
+    static struct op ops[BENCH_KERNEL_BATCH];
+    static u32 results[BENCH_KERNEL_BATCH];
+    struct cpu *cpu = calloc(1, sizeof(*cpu));
+    assert(cpu);
+    u64 state = 1;
+
+    u32 nimage = 0;
+    for (u32 pos = 0; pos < asm_data.ndata && nimage < BENCH_KERNEL_BATCH; ) {
+        struct op op;
+        int size = decode_op(asm_data.data + pos, asm_data.ndata - pos, &op);
+        assert(size > 0);
+        switch (op.type) {
+        case op_MOV_RM_TO_REG: case op_MOV_IMM_TO_RM: case op_MOV_RM_TO_SREG: case op_MOV_SREG_TO_RM:
+        case op_ADD: case op_ADD_IMM_TO_RM: case op_SUB: case op_SUB_IMM_TO_RM: case op_CMP: case op_CMP_IMM_TO_RM:
+            if (op.mod != 0b11) {
+                ops[nimage++] = op;
+            }
+            break;
+        default: break;
+        }
+        pos += size;
+    }
+    for (u32 i = nimage; i < BENCH_KERNEL_BATCH; i++) {
+        // NOTE: images without memory operands get random mod/rm pairs
+        u64 x = xorshift64(&state);
+        ops[i] = (nimage) ? ops[i % nimage] : (struct op){.mod = x % 3, .rm = (x >> 2) & 7, .disp = x >> 8};
+    }
+    for (int i = 0; i < reg_num; i++) {
+        cpu->regs[i] = xorshift64(&state);
+    }
+    for (u32 i = 0; i < BENCH_KERNEL_BATCH; i++) {
+        results[i] = xorshift64(&state);
+        assert(parity_loop(results[i]) == !__builtin_parity(results[i] & 0xff));
+        assert(effective_address_switch(cpu, ops[i]) == cpu_op_effective_address(cpu, ops[i]));
+    }
+
+    struct {
+        const char *name;
+        u64 elapsed;
+        u64 ncalls;
+    } kernels[4] = {{"parity loop"}, {"parity popcount"}, {"ea switch"}, {"ea table"}};
+    u64 checksum = 0;
+    for (int k = 0; k < len(kernels); k++) {
+        while (kernels[k].elapsed < 100 * Milliseconds) {
+            u64 started = now();
+            for (int rep = 0; rep < 64; rep++) {
+                switch (k) {
+                case 0: for (u32 i = 0; i < BENCH_KERNEL_BATCH; i++) checksum += parity_loop(results[i] + rep); break;
+                case 1: for (u32 i = 0; i < BENCH_KERNEL_BATCH; i++) checksum += !__builtin_parity((results[i] + rep) & 0xff); break;
+                case 2: for (u32 i = 0; i < BENCH_KERNEL_BATCH; i++) checksum += effective_address_switch(cpu, ops[i]); break;
+                case 3: for (u32 i = 0; i < BENCH_KERNEL_BATCH; i++) checksum += cpu_op_effective_address(cpu, ops[i]); break;
+                }
+                cpu->regs[rep & 7] += rep;
+            }
+            kernels[k].elapsed += now() - started;
+            kernels[k].ncalls += 64 * BENCH_KERNEL_BATCH;
+        }
+    }
+
+    // NOTE: untraced runs for the cost of a whole simulated op, as -bench-exec
+    u64 elapsed = 0;
+    u64 nexecuted = 0;
+    while (elapsed < 100 * Milliseconds) {
+        memset(cpu, 0, sizeof(*cpu));
+        cpu->powered = true;
+        u64 started = now();
+        struct prog prog = cpu_run(cpu, asm_data);
+        elapsed += now() - started;
+        prog_free(&prog);
+        nexecuted += cpu->nexecuted;
+    }
+    f64 op_ns = (nexecuted) ? (f64)elapsed / Seconds * 1e9 / nexecuted : 0;
+
+    printf("%s: exec %.2f ns/op (checksum %lu)\n", path, op_ns, checksum);
+    for (int k = 0; k < len(kernels); k++) {
+        f64 ns = (f64)kernels[k].elapsed / Seconds * 1e9 / kernels[k].ncalls;
+        printf("%s: %-15s %6.3f ns/call %5.1f%% of an op\n", path, kernels[k].name, ns, (op_ns > 0) ? 100 * ns / op_ns : 0.0);
+    }
+    free(cpu);
+}
+#endif
+
+static void
+cpu_regs(struct cpu *cpu, u16 regs[reg_num]) {
+    for (int i = 0; i < reg_num; i++) {
+        regs[i] = cpu->regs[i];
+    }
+}
+
+static void
+cpu_print_regs(struct cpu *cpu) {
+    u16 regs[reg_num];
+    cpu_regs(cpu, regs);
+    trace_regs(&cpu->trace, regs, cpu->sregs, cpu->ip, cpu_flags(cpu), cpu->print_ip);
+}
+
+#ifndef C8086_LIBRARY
+#define MEMORY_DIFF_ROW 16
+
+static const u8 zero_page[SNAPSHOT_PAGE_SIZE];
+
+static void
+trace_memory_row(struct trace *t, char sign, u32 address, const u8 *row) {
+    static const char hex[] = "0123456789abcdef";
+    trace_char(t, '\t');
+    trace_char(t, sign);
+    trace_hex(t, address, 5);
+    trace_char(t, ':');
+    u8 *data = trace_reserve(t, MEMORY_DIFF_ROW * 3 + 1);
+    for (int i = 0; i < MEMORY_DIFF_ROW; i++) {
+        data[i * 3 + 0] = ' ';
+        data[i * 3 + 1] = hex[row[i] >> 4];
+        data[i * 3 + 2] = hex[row[i] & 0xf];
+    }
+    data[MEMORY_DIFF_ROW * 3] = '\n';
+}
+
+// NOTE: only dirty pages can differ from memory at the start of the run, and
+// only the rows of them that really changed are printed, old then new
+static void
+cpu_print_memory_diff(struct cpu *cpu) {
+    const struct snapshot *baseline = &cpu->memory_baseline;
+    struct trace *t = &cpu->trace;
+    trace_str(t, "\nMemory changes:\n");
+
+    u32 nrows = 0;
+    u32 next = 0;
+    for (int i = 0; i < len(cpu->dirty); i++) {
+        for (u64 bits = cpu->dirty[i]; bits; bits &= bits - 1) {
+            u32 page = i * 64 + __builtin_ctzll(bits);
+            while (next < baseline->npages && baseline->pages[next] < page) {
+                next++;
+            }
+            const u8 *old = zero_page;
+            if (next < baseline->npages && baseline->pages[next] == page) {
+                old = baseline->data + next * SNAPSHOT_PAGE_SIZE;
+            }
+            u32 address = page << SNAPSHOT_PAGE_SHIFT;
+            for (u32 row = 0; row < SNAPSHOT_PAGE_SIZE; row += MEMORY_DIFF_ROW) {
+                if (memcmp(old + row, cpu->memory + address + row, MEMORY_DIFF_ROW) != 0) {
+                    trace_memory_row(t, '-', address + row, old + row);
+                    trace_memory_row(t, '+', address + row, cpu->memory + address + row);
+                    nrows++;
+                }
+            }
+        }
+    }
+    if (!nrows) {
+        trace_str(t, "\tnone\n");
+    }
+}
+#endif
+
+// NOTE: library API, the core behind the opaque struct c8086. Each call
+// works on one cpu, a process can drive as many as it likes
+struct c8086 {
+    struct cpu cpu;
+};
+
+struct c8086 *
+c8086_create(void) {
+    // NOTE: calloc maps zero pages lazily, a cpu that touches little memory stays small
+    struct c8086 *c = calloc(1, sizeof(*c));
+    assert(c);
+    c->cpu.powered = true;
+    return c;
+}
+
+void
+c8086_destroy(struct c8086 *c) {
+    struct cpu *cpu = &c->cpu;
+    free(cpu->decoded);
+    trace_close(&cpu->trace);
+    free(c);
+}
+
+// NOTE: back to power on, clearing only the pages the last image dirtied;
+// the trace callback and the breakpoints stay
+void
+c8086_reset(struct c8086 *c) {
+    struct cpu *cpu = &c->cpu;
+    free(cpu->decoded);
+    cpu->decoded = NULL;
+    cpu_restore_snapshot(cpu, &(struct snapshot){});
+    cpu->resumed = false;
+    cpu->nexecuted = 0;
+    cpu->total_clocks = 0;
+    cpu->decode_hits = 0;
+    cpu->decode_misses = 0;
+    cpu->fault = NULL;
+}
+
+bool
+c8086_load(struct c8086 *c, const void *data, u32 ndata, u16 segment) {
+    struct cpu *cpu = &c->cpu;
+    cpu->load_segment = segment;
+    if (!cpu_image_fits(cpu, ndata)) {
+        return false;
+    }
+    cpu_load_image(cpu, data, ndata);
+    free(cpu->decoded);
+    cpu->decoded = calloc((cpu->nbytes) ? cpu->nbytes : 1, sizeof(*cpu->decoded));
+    assert(cpu->decoded);
+    return true;
+}
+
+void
+c8086_set_trace(struct c8086 *c, trace_write_proc write, void *user, bool print_ip) {
+    struct cpu *cpu = &c->cpu;
+    trace_flush(&cpu->trace);
+    cpu->trace.write = write;
+    cpu->trace.user = user;
+    cpu->print_ip = print_ip;
+}
+
+void
+c8086_set_breakpoint(struct c8086 *c, u16 ip) {
+    stops_add_breakpoint(&c->cpu.stops, ip);
+}
+
+void
+c8086_clear_breakpoint(struct c8086 *c, u16 ip) {
+    stops_remove_breakpoint(&c->cpu.stops, ip);
+}
+
+// NOTE: count 0 - no limit. The op at a breakpoint runs when it is the
+// first one of the call, so stepping again moves past the breakpoint
+enum c8086_status
+c8086_step(struct c8086 *c, u64 count) {
+    struct cpu *cpu = &c->cpu;
+    struct prog prog = {};
+    enum stop_reason reason = cpu_run_checked(cpu, &prog, count);
+    prog_free(&prog);
+    trace_flush(&cpu->trace);
+
+    if (cpu->fault) {
+        return c8086_UNSUPPORTED;
+    }
+    if (cpu->ip >= cpu->nbytes) {
+        return c8086_HALTED;
+    }
+    return (reason == stop_BREAKPOINT) ? c8086_BREAKPOINT : c8086_STEPPED;
+}
+
+// NOTE: the image to its end on one engine. Only the interpreter stops at
+// breakpoints and traces, the block engines run untraced straight through
+enum c8086_status
+c8086_run(struct c8086 *c, enum c8086_engine engine) {
+    struct cpu *cpu = &c->cpu;
+    if (engine == c8086_INTERPRETER) {
+        return c8086_step(c, 0);
+    }
+
+    struct prog prog = {};
+    cpu->fast = true;
+    cpu->use_jit = engine == c8086_JIT;
+    cpu_run_fast(cpu, &prog);
+    cpu->fast = false;
+    cpu->use_jit = false;
+    prog_free(&prog);
+    return (cpu->fault) ? c8086_UNSUPPORTED : c8086_HALTED;
+}
+
+u16
+c8086_reg(struct c8086 *c, enum reg reg) {
+    return c->cpu.regs[reg];
+}
+
+u16
+c8086_sreg(struct c8086 *c, enum sreg sreg) {
+    return c->cpu.sregs[sreg];
+}
+
+u16
+c8086_ip(struct c8086 *c) {
+    return c->cpu.ip;
+}
+
+enum flags
+c8086_flags(struct c8086 *c) {
+    return cpu_flags(&c->cpu);
+}
+
+// NOTE: addresses wrap at 1 MiB like the bus does
+void
+c8086_read_memory(struct c8086 *c, u32 address, void *out, u32 n) {
+    struct cpu *cpu = &c->cpu;
+    u8 *bytes = out;
+    for (u32 i = 0; i < n; i++) {
+        bytes[i] = cpu_read_byte(cpu, address + i);
+    }
+}
+
+// NOTE: the "Final registers" block the command line prints, through the trace callback
+void
+c8086_trace_regs(struct c8086 *c) {
+    struct cpu *cpu = &c->cpu;
+    cpu_print_regs(cpu);
+    trace_flush(&cpu->trace);
+}
+
+#ifndef C8086_LIBRARY
+// NOTE: a flat image where the file offset is the address; dirty pages that are
+// all zero are skipped with fseek and stay holes, the file ends at the last one
+// with data, so a run that touches a few pages writes a few pages
+static bool
+cpu_dump_memory(struct cpu *cpu, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < len(cpu->dirty); i++) {
+        for (u64 bits = cpu->dirty[i]; bits; bits &= bits - 1) {
+            u32 address = (i * 64 + __builtin_ctzll(bits)) << SNAPSHOT_PAGE_SHIFT;
+            if (memcmp(cpu->memory + address, zero_page, SNAPSHOT_PAGE_SIZE) == 0) {
+                continue;
+            }
+            ok = ok && fseek(file, address, SEEK_SET) == 0;
+            ok = ok && fwrite(cpu->memory + address, 1, SNAPSHOT_PAGE_SIZE, file) == SNAPSHOT_PAGE_SIZE;
+        }
+    }
+    return (fclose(file) == 0) && ok;
+}
+
+// NOTE: only with -stats, on purpose. The default summary is the final
+// registers in the reference listings' format, which tests/ and the engine
+// comparisons diff, and the hit rate differs between the engines
+static void
+cpu_print_stats(struct cpu *cpu) {
+    u64 lookups = cpu->decode_hits + cpu->decode_misses;
+    trace_flush(&cpu->trace);
+    fprintf(cpu->trace.out, "Decode cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+           cpu->decode_hits, cpu->decode_misses, lookups ? 100.0 * cpu->decode_hits / lookups : 0.0);
+    if (cpu->use_jit) {
+        fprintf(cpu->trace.out, "JIT: %u blocks compiled\n", cpu->jit.ncompiled);
+    }
+}
+
+struct profile_entry {
+    u32 key; // NOTE: ip, address or op type
+    u64 count;
+};
+
+static int
+compare_profile_entries(const void *a, const void *b) {
+    const struct profile_entry *x = a, *y = b;
+    if (x->count != y->count) {
+        return (x->count > y->count) ? -1 : 1;
+    }
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+// NOTE: nonzero counts sorted hottest first, the caller frees the entries
+static struct profile_entry *
+profile_sort(const void *counts, bool wide, u32 ncounts, u32 *nentries) {
+    struct profile_entry *entries = NULL;
+    u32 n = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        n = 0;
+        for (u32 i = 0; i < ncounts; i++) {
+            u64 count = (wide) ? ((const u64 *)counts)[i] : ((const u32 *)counts)[i];
+            if (count) {
+                if (entries) {
+                    entries[n] = (struct profile_entry){i, count};
+                }
+                n++;
+            }
+        }
+        if (!entries) {
+            entries = malloc((n ? n : 1) * sizeof(*entries));
+            assert(entries);
+        }
+    }
+    qsort(entries, n, sizeof(*entries), compare_profile_entries);
+    *nentries = n;
+    return entries;
+}
+
+// NOTE: disassembly of the op currently in memory at ip
+static void
+profile_print_op(struct trace *t, struct cpu *cpu, u16 ip) {
+    struct op op;
+    if (decode_op(cpu->instructions + ip, cpu->nbytes - ip, &op) > 0) {
+        print_op(t, op);
+    } else {
+        trace_char(t, '?');
+    }
+}
+
+#define PROFILE_TOP 10
+
+static void
+profile_print_counts(struct trace *t, const char *title, const void *counts, bool wide, u32 ncounts, struct cpu *cpu) {
+    u32 nentries;
+    struct profile_entry *entries = profile_sort(counts, wide, ncounts, &nentries);
+    trace_str(t, title);
+    trace_str(t, ":\n");
+    for (u32 i = 0; i < nentries && i < PROFILE_TOP; i++) {
+        trace_char(t, '\t');
+        trace_hex(t, entries[i].key, (ncounts > 0x10000) ? 5 : 4);
+        trace_char(t, '\t');
+        trace_uint(t, entries[i].count);
+        if (cpu) {
+            trace_char(t, '\t');
+            profile_print_op(t, cpu, entries[i].key);
+        }
+        trace_char(t, '\n');
+    }
+    free(entries);
+}
+
+// NOTE: hot spot report after the final registers, hottest first
+static void
+cpu_print_profile(struct cpu *cpu) {
+    struct trace *t = &cpu->trace;
+    struct profile *profile = &cpu->profile;
+
+    profile_print_counts(t, "Hot ips", profile->ip_counts, true, cpu->nbytes, cpu);
+
+    u32 nentries;
+    struct profile_entry *entries = profile_sort(profile->op_counts, true, op_num, &nentries);
+    trace_str(t, "Op types (count, host cycles, cycles per op):\n");
+    for (u32 i = 0; i < nentries; i++) {
+        u64 cycles = profile->op_cycles[entries[i].key];
+        trace_char(t, '\t');
+        trace_str(t, op_type_names[entries[i].key]);
+        trace_char(t, '\t');
+        trace_uint(t, entries[i].count);
+        trace_char(t, '\t');
+        trace_uint(t, cycles);
+        trace_char(t, '\t');
+        trace_uint(t, cycles / entries[i].count);
+        trace_char(t, '\n');
+    }
+    free(entries);
+
+    trace_str(t, "Jumps (taken, not taken):\n");
+    for (u32 ip = 0; ip < cpu->nbytes; ip++) {
+        if (profile->taken[ip] || profile->not_taken[ip]) {
+            trace_char(t, '\t');
+            trace_hex(t, ip, 4);
+            trace_char(t, '\t');
+            trace_uint(t, profile->taken[ip]);
+            trace_char(t, '\t');
+            trace_uint(t, profile->not_taken[ip]);
+            trace_char(t, '\t');
+            profile_print_op(t, cpu, ip);
+            trace_char(t, '\n');
+        }
+    }
+
+    profile_print_counts(t, "Memory reads", profile->reads, false, MEMORY_MASK + 1, NULL);
+    profile_print_counts(t, "Memory writes", profile->writes, false, MEMORY_MASK + 1, NULL);
+}
+
+// NOTE: every executed ip, as csv rows together with the memory counts,
+// or as "path;op type;ip op count" lines for flamegraph.pl
+static bool
+cpu_write_profile(struct cpu *cpu, const char *path, const char *out_path, bool collapsed) {
+    struct trace t = {.out = fopen(out_path, "w")};
+    if (!t.out) {
+        return false;
+    }
+
+    struct profile *profile = &cpu->profile;
+    if (!collapsed) {
+        trace_str(&t, "kind,address,count,taken,not_taken,op\n");
+    }
+    for (u32 ip = 0; ip < cpu->nbytes; ip++) {
+        if (!profile->ip_counts[ip]) {
+            continue;
+        }
+        struct op op = {};
+        decode_op(cpu->instructions + ip, cpu->nbytes - ip, &op);
+        if (collapsed) {
+            trace_str(&t, path);
+            trace_char(&t, ';');
+            trace_str(&t, op_type_names[op.type]);
+            trace_char(&t, ';');
+            trace_hex(&t, ip, 4);
+            trace_char(&t, ' ');
+            profile_print_op(&t, cpu, ip);
+            trace_char(&t, ' ');
+            trace_uint(&t, profile->ip_counts[ip]);
+        } else {
+            trace_str(&t, "ip,");
+            trace_hex(&t, ip, 4);
+            trace_char(&t, ',');
+            trace_uint(&t, profile->ip_counts[ip]);
+            trace_char(&t, ',');
+            trace_uint(&t, profile->taken[ip]);
+            trace_char(&t, ',');
+            trace_uint(&t, profile->not_taken[ip]);
+            trace_str(&t, ",\"");
+            profile_print_op(&t, cpu, ip);
+            trace_char(&t, '"');
+        }
+        trace_char(&t, '\n');
+    }
+
+    for (int kind = 0; kind < 2 && !collapsed; kind++) {
+        const u32 *counts = (kind == 0) ? profile->reads : profile->writes;
+        for (u32 address = 0; address <= MEMORY_MASK; address++) {
+            if (counts[address]) {
+                trace_str(&t, (kind == 0) ? "read," : "write,");
+                trace_hex(&t, address, 5);
+                trace_char(&t, ',');
+                trace_uint(&t, counts[address]);
+                trace_str(&t, ",,,\n");
+            }
+        }
+    }
+
+    trace_close(&t);
+    return fclose(t.out) == 0;
+}
+
+// NOTE: everything a single run prints, shared by main and -batch
+static void
+cpu_simulate(struct cpu *cpu, const char *path, struct buffer asm_data, bool stats) {
+    struct trace *t = &cpu->trace;
+    if (cpu->powered) {
+        trace_str(t, "--- ");
+        trace_str(t, path);
+        trace_str(t, " execution ---\n");
+    } else {
+        trace_str(t, "; ");
+        trace_str(t, path);
+        trace_str(t, "\n\nbits 16\n");
+    }
+    if (cpu->binary_trace.out) {
+        trace_binary_header(&cpu->binary_trace, path, cpu->print_ip);
+    }
+
+    struct prog prog = cpu_run(cpu, asm_data);
+    prog_free(&prog);
+    if (cpu->jit.fallback) {
+        fprintf(stderr, "%s, fell back to threaded code\n", cpu->jit.fallback);
+    }
+    if (cpu->stops.reason) {
+        cpu_print_stop(cpu);
+    }
+    if (cpu->fault) {
+        trace_str(t, "Stopped at ");
+        trace_hex(t, cpu->ip, 4);
+        trace_str(t, ": ");
+        trace_str(t, cpu->fault);
+        trace_char(t, '\n');
+    }
+    trace_char(t, '\n');
+
+    if (cpu->powered) {
+        cpu_print_regs(cpu);
+        if (cpu->memory_diff) {
+            cpu_print_memory_diff(cpu);
+            snapshot_free(&cpu->memory_baseline);
+        }
+        if (stats) {
+            cpu_print_stats(cpu);
+        }
+        if (cpu->profile.ip_counts) {
+            cpu_print_profile(cpu);
+        }
+    }
+    if (cpu->binary_trace.out) {
+        u16 regs[reg_num];
+        cpu_regs(cpu, regs);
+        trace_binary_final(&cpu->binary_trace, regs, cpu->sregs, cpu->ip, cpu_flags(cpu));
+        trace_close(&cpu->binary_trace);
+    }
+    trace_close(t);
+}
+
+// NOTE: snapshot file, little-endian:
+//   "C86S", u8 version, u16 regs[reg_num], u16 sregs[sreg_num], u16 ip,
+//   u8 flags, u16 load_segment, u32 nbytes, u32 npages,
+//   then u16 page number and SNAPSHOT_PAGE_SIZE bytes for every page
+#define SNAPSHOT_MAGIC "C86S"
+#define SNAPSHOT_VERSION 1
+
+static bool
+snapshot_write(const struct snapshot *snapshot, const char *path) {
+    struct trace t = {.out = fopen(path, "wb")};
+    if (!t.out) {
+        return false;
+    }
+    trace_bytes(&t, SNAPSHOT_MAGIC, 4);
+    trace_u8(&t, SNAPSHOT_VERSION);
+    for (int i = 0; i < reg_num; i++) {
+        trace_u16(&t, snapshot->regs[i]);
+    }
+    for (int i = 0; i < sreg_num; i++) {
+        trace_u16(&t, snapshot->sregs[i]);
+    }
+    trace_u16(&t, snapshot->ip);
+    trace_u8(&t, snapshot->flags);
+    trace_u16(&t, snapshot->load_segment);
+    trace_u16(&t, snapshot->nbytes);
+    trace_u16(&t, snapshot->nbytes >> 16);
+    trace_u16(&t, snapshot->npages);
+    trace_u16(&t, snapshot->npages >> 16);
+    for (u32 i = 0; i < snapshot->npages; i++) {
+        trace_u16(&t, snapshot->pages[i]);
+        trace_bytes(&t, snapshot->data + i * SNAPSHOT_PAGE_SIZE, SNAPSHOT_PAGE_SIZE);
+    }
+    trace_close(&t);
+    return fclose(t.out) == 0;
+}
+
+static u8
+read_u8(const u8 **at, const u8 *end) {
+    assert(*at + 1 <= end && "truncated trace");
+    u8 result = (*at)[0];
+    *at += 1;
+    return result;
+}
+
+static u16
+read_u16(const u8 **at, const u8 *end) {
+    assert(*at + 2 <= end && "truncated trace");
+    u16 result = (*at)[0] | ((*at)[1] << 8);
+    *at += 2;
+    return result;
+}
+
+// NOTE: unchanged entries stay 0 on both sides
+static void
+read_deltas(const u8 **at, const u8 *end, u16 *old_values, u16 *new_values, int n) {
+    u8 changed = read_u8(at, end);
+    for (int i = 0; i < n; i++) {
+        if (changed & (1 << i)) {
+            old_values[i] = read_u16(at, end);
+            new_values[i] = read_u16(at, end);
+        }
+    }
+}
+
+static bool
+snapshot_read(const char *path, struct snapshot *snapshot) {
+    struct buffer data = load_file(path);
+    const u8 *at = data.data;
+    const u8 *end = at + data.ndata;
+    if (data.ndata < 5 || memcmp(at, SNAPSHOT_MAGIC, 4) != 0 || at[4] != SNAPSHOT_VERSION) {
+        free_buffer(&data);
+        return false;
+    }
+    at += 5;
+
+    *snapshot = (struct snapshot){};
+    for (int i = 0; i < reg_num; i++) {
+        snapshot->regs[i] = read_u16(&at, end);
+    }
+    for (int i = 0; i < sreg_num; i++) {
+        snapshot->sregs[i] = read_u16(&at, end);
+    }
+    snapshot->ip = read_u16(&at, end);
+    snapshot->flags = read_u8(&at, end);
+    snapshot->load_segment = read_u16(&at, end);
+    snapshot->nbytes = read_u16(&at, end);
+    snapshot->nbytes |= read_u16(&at, end) << 16;
+    snapshot->npages = read_u16(&at, end);
+    snapshot->npages |= read_u16(&at, end) << 16;
+    assert(snapshot->npages <= SNAPSHOT_NPAGES && snapshot->nbytes < 0x10000);
+
+    snapshot->pages = malloc((snapshot->npages ? snapshot->npages : 1) * sizeof(*snapshot->pages));
+    snapshot->data = malloc((snapshot->npages ? snapshot->npages : 1) * SNAPSHOT_PAGE_SIZE);
+    assert(snapshot->pages && snapshot->data);
+    for (u32 i = 0; i < snapshot->npages; i++) {
+        snapshot->pages[i] = read_u16(&at, end);
+        assert(snapshot->pages[i] < SNAPSHOT_NPAGES);
+        assert(at + SNAPSHOT_PAGE_SIZE <= end && "truncated snapshot");
+        memcpy(snapshot->data + i * SNAPSHOT_PAGE_SIZE, at, SNAPSHOT_PAGE_SIZE);
+        at += SNAPSHOT_PAGE_SIZE;
+    }
+
+    free_buffer(&data);
+    return true;
+}
+
+// NOTE: print a -trace-bin file as the text -exec would have printed
+static int
+render_trace(const char *path) {
+    struct buffer data = load_file(path);
+    const u8 *at = data.data;
+    const u8 *end = at + data.ndata;
+
+    if (data.ndata < 8 || memcmp(at, TRACE_MAGIC, 4) != 0 || at[4] != TRACE_VERSION) {
+        fprintf(stderr, "'%s' is not a c8086 trace\n", path);
+        free_buffer(&data);
+        return 1;
+    }
+    at += 5;
+    bool print_ip = read_u8(&at, end);
+    u16 npath = read_u16(&at, end);
+    assert(at + npath <= end && "truncated trace");
+
+    struct trace t = {.out = stdout};
+    trace_str(&t, "--- ");
+    trace_bytes(&t, at, npath);
+    trace_str(&t, " execution ---\n");
+    at += npath;
+
+    for (;;) {
+        struct trace_record record = {.kind = read_u8(&at, end)};
+        if (record.kind == trace_FINAL) {
+            u16 regs[reg_num];
+            for (int i = 0; i < reg_num; i++) {
+                regs[i] = read_u16(&at, end);
+            }
+            u16 sregs[sreg_num];
+            for (int i = 0; i < sreg_num; i++) {
+                sregs[i] = read_u16(&at, end);
+            }
+            u16 ip = read_u16(&at, end);
+            enum flags flags = read_u8(&at, end);
+
+            trace_char(&t, '\n');
+            trace_regs(&t, regs, sregs, ip, flags, print_ip);
+            break;
+        }
+        assert(record.kind == trace_OP || record.kind == trace_SKIPPED_OP);
+
+        record.ip = read_u16(&at, end);
+        record.next_ip = read_u16(&at, end);
+        record.size = read_u8(&at, end);
+        assert(record.size <= len(record.bytes) && at + record.size <= end);
+        memcpy(record.bytes, at, record.size);
+        at += record.size;
+        record.old_flags = read_u8(&at, end);
+        record.new_flags = read_u8(&at, end);
+
+        read_deltas(&at, end, record.old_regs, record.new_regs, reg_num);
+        read_deltas(&at, end, record.old_sregs, record.new_sregs, sreg_num);
+
+        struct op op;
+        int size = decode_op(record.bytes, record.size, &op);
+        assert(size == record.size);
+        trace_text_record(&t, &record, op, print_ip);
+    }
+
+    trace_close(&t);
+    free_buffer(&data);
+    return 0;
+}
+
+#define STREAM_CHUNK_SIZE (64 << 10)
+
+// NOTE: -disasm-stream, reads PATH or stdin ("-") chunk_size bytes at a time;
+// an op cut off by the end of a chunk is moved to the front and completed by
+// the next read, so memory stays at one chunk and one trace buffer
+static int
+disasm_stream(const char *path, u32 chunk_size) {
+    int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open '%s'\n", path);
+        return 1;
+    }
+
+    u8 *data = malloc(chunk_size + OP_MAX_SIZE);
+    assert(data);
+    struct trace t = {.out = stdout};
+    trace_str(&t, "; ");
+    trace_str(&t, path);
+    trace_str(&t, "\n\nbits 16\n");
+
+    int result = 0;
+    u64 offset = 0; // NOTE: of data[0] in the input
+    u32 ndata = 0;
+    for (bool eof = false; !eof; ) {
+        ssize_t nread = read(fd, data + ndata, chunk_size);
+        if (nread < 0) {
+            fprintf(stderr, "Cannot read '%s'\n", path);
+            result = 1;
+            break;
+        }
+        eof = nread == 0;
+        ndata += nread;
+
+        u32 pos = 0;
+        for (;;) {
+            struct op op;
+            int size = decode_op(data + pos, ndata - pos, &op);
+            if (size <= 0) {
+                if (size < 0 || (eof && pos < ndata)) {
+                    fprintf(stderr, "%s at offset 0x%lx in '%s'\n",
+                            (size < 0) ? "Unsupported op" : "Truncated op", offset + pos, path);
+                    result = 1;
+                    eof = true;
+                }
+                break;
+            }
+            print_op(&t, op);
+            trace_char(&t, '\n');
+            pos += size;
+        }
+
+        memmove(data, data + pos, ndata - pos);
+        ndata -= pos;
+        offset += pos;
+
+        // NOTE: every chunk is written out right away, not when the buffer fills
+        trace_flush(&t);
+        fflush(t.out);
+    }
+
+    trace_char(&t, '\n');
+    trace_close(&t);
+    free(data);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return result;
+}
+
+// NOTE: one op of a speculatively decoded chunk, size 0 - unsupported or cut off
+struct disasm_line {
+    u32 start;
+    u32 text_end; // NOTE: end of its line in the worker text
+    u8 size;
+};
+
+// NOTE: -disasm-parallel, decodes [begin, end) as if begin was an op boundary
+struct disasm_worker {
+    pthread_t thread;
+    const u8 *data;
+    u32 ndata;
+    u32 begin;
+    u32 end;
+
+    struct disasm_line *lines;
+    u32 nlines;
+    char *text;
+    size_t ntext;
+};
+
+static void *
+disasm_worker_main(void *arg) {
+    struct disasm_worker *w = arg;
+    u32 capacity = (w->end - w->begin) / 3 + 16;
+    w->lines = malloc(capacity * sizeof(*w->lines));
+    assert(w->lines);
+
+    struct trace t = {.out = open_memstream(&w->text, &w->ntext)};
+    assert(t.out);
+    for (u32 pos = w->begin; pos < w->end; ) {
+        if (w->nlines == capacity) {
+            capacity *= 2;
+            w->lines = realloc(w->lines, capacity * sizeof(*w->lines));
+            assert(w->lines);
+        }
+
+        struct op op;
+        int size = decode_op(w->data + pos, w->ndata - pos, &op);
+        struct disasm_line *line = w->lines + w->nlines++;
+        line->start = pos;
+        line->size = (size > 0) ? size : 0;
+        if (size > 0) {
+            print_op(&t, op);
+            trace_char(&t, '\n');
+            pos += size;
+        } else {
+            // NOTE: most likely a wrong guess at the boundary, keep speculating
+            pos++;
+        }
+        line->text_end = t.nwritten + t.size;
+    }
+    trace_close(&t);
+    fclose(t.out);
+    return NULL;
+}
+
+// NOTE: true op boundaries are only known from offset 0 on; each chunk's
+// lines are used from the first one that starts on a true boundary, the ops
+// before it are decoded again here. Decoding is deterministic, so from that
+// line on the chunk is exactly what the serial decoder would produce
+static bool
+disasm_stitch(struct disasm_worker *workers, int nworkers, struct trace *out, u32 *error_at) {
+    u32 pos = 0;
+    for (int i = 0; i < nworkers; i++) {
+        struct disasm_worker *w = workers + i;
+        u32 k = 0;
+        while (pos < w->end) {
+            while (k < w->nlines && w->lines[k].start < pos) {
+                k++;
+            }
+            if (k < w->nlines && w->lines[k].start == pos) {
+                break;
+            }
+            struct op op;
+            int size = decode_op(w->data + pos, w->ndata - pos, &op);
+            if (size <= 0) {
+                *error_at = pos;
+                return false;
+            }
+            print_op(out, op);
+            trace_char(out, '\n');
+            pos += size;
+        }
+        if (pos >= w->end) {
+            continue;
+        }
+
+        for (u32 j = k; j < w->nlines; j++) {
+            if (!w->lines[j].size) {
+                *error_at = w->lines[j].start;
+                return false;
+            }
+        }
+        u32 text_begin = (k) ? w->lines[k - 1].text_end : 0;
+        struct disasm_line *last = w->lines + w->nlines - 1;
+        trace_bytes(out, w->text + text_begin, last->text_end - text_begin);
+        pos = last->start + last->size;
+    }
+    return true;
+}
+
+// NOTE: same output as the serial disassembly, nthreads 0 - one per core
+static bool
+disasm_parallel(const char *path, struct buffer asm_data, int nthreads, struct trace *out) {
+    if (nthreads <= 0) {
+        long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncores < 1) ? 1 : ncores;
+    }
+    u32 ndata = asm_data.ndata;
+    if ((u32)nthreads > ndata) {
+        nthreads = (ndata) ? ndata : 1;
+    }
+
+    struct disasm_worker *workers = calloc(nthreads, sizeof(*workers));
+    assert(workers);
+    for (int i = 0; i < nthreads; i++) {
+        workers[i] = (struct disasm_worker){
+            .data = asm_data.data,
+            .ndata = ndata,
+            .begin = (u64)ndata * i / nthreads,
+            .end = (u64)ndata * (i + 1) / nthreads,
+        };
+        int error = pthread_create(&workers[i].thread, NULL, disasm_worker_main, workers + i);
+        assert(!error);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    trace_str(out, "; ");
+    trace_str(out, path);
+    trace_str(out, "\n\nbits 16\n");
+    u32 error_at = 0;
+    bool result = disasm_stitch(workers, nthreads, out, &error_at);
+    if (result) {
+        trace_char(out, '\n');
+    } else {
+        fprintf(stderr, "Unsupported op at offset 0x%x in '%s'\n", error_at, path);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        free(workers[i].lines);
+        free(workers[i].text);
+    }
+    free(workers);
+    return result;
+}
+
+// NOTE: random streams of supported ops, disassembled serially through
+// cpu_simulate and in parallel with different thread counts, byte for byte
+static int
+disasm_selftest(u64 seed) {
+    u64 state = seed ? seed : 1;
+    struct cpu *cpu = calloc(1, sizeof(*cpu));
+    assert(cpu);
+
+    int nstreams = 200;
+    int nfailed = 0;
+    for (int i = 0; i < nstreams; i++) {
+        u32 capacity = 1 + xorshift64(&state) % (64 << 10);
+        u8 *data = malloc(capacity + OP_MAX_SIZE);
+        assert(data);
+        u32 ndata = 0;
+        while (ndata < capacity) {
+            u8 candidate[OP_MAX_SIZE];
+            for (int j = 0; j < OP_MAX_SIZE; j++) {
+                candidate[j] = xorshift64(&state);
+            }
+            struct op op;
+            int size = decode_op(candidate, OP_MAX_SIZE, &op);
+            if (size > 0) {
+                memcpy(data + ndata, candidate, size);
+                ndata += size;
+            }
+        }
+        struct buffer asm_data = {.data = data, .ndata = ndata};
+
+        char *serial;
+        size_t nserial;
+        memset(cpu, 0, sizeof(*cpu));
+        cpu->trace.out = open_memstream(&serial, &nserial);
+        assert(cpu->trace.out);
+        cpu_simulate(cpu, "random", asm_data, false);
+        fclose(cpu->trace.out);
+
+        int nthreads = 1 + xorshift64(&state) % 16;
+        char *parallel;
+        size_t nparallel;
+        struct trace t = {.out = open_memstream(&parallel, &nparallel)};
+        assert(t.out);
+        bool ok = disasm_parallel("random", asm_data, nthreads, &t);
+        trace_close(&t);
+        fclose(t.out);
+
+        if (!ok || nserial != nparallel || memcmp(serial, parallel, nserial) != 0) {
+            fprintf(stderr, "disasm-selftest: stream %d (%u bytes, %d threads) differs\n", i, ndata, nthreads);
+            nfailed++;
+        }
+        free(serial);
+        free(parallel);
+        free(data);
+    }
+    free(cpu);
+
+    printf("disasm-selftest: %d of %d random streams match (seed %lu)\n", nstreams - nfailed, nstreams, seed);
+    return (nfailed) ? 1 : 0;
+}
+
+// NOTE: next line that diff -w -B -I "---" would compare
+static const char *
+skip_ignored_lines(const char *text) {
+    while (*text) {
+        const char *end = strchrnul(text, '\n');
+        bool blank = true;
+        for (const char *c = text; c < end; c++) {
+            if (!isspace(*c)) {
+                blank = false;
+            }
+        }
+        if (!blank && !memmem(text, end - text, "---", 3)) {
+            break;
+        }
+        text = (*end) ? end + 1 : end;
+    }
+    return text;
+}
+
+static bool
+is_line_end(const char *c) {
+    return *c == '\0' || *c == '\n';
+}
+
+// NOTE: true when outputs match ignoring whitespace, blank and "---" lines,
+// otherwise points both line pointers at the first difference
+static bool
+outputs_match(const char *expected, const char *actual, const char **expected_line, const char **actual_line) {
+    for (;;) {
+        expected = *expected_line = skip_ignored_lines(expected);
+        actual = *actual_line = skip_ignored_lines(actual);
+        if (!*expected || !*actual) {
+            return !*expected && !*actual;
+        }
+
+        for (;;) {
+            while (!is_line_end(expected) && isspace(*expected)) expected++;
+            while (!is_line_end(actual) && isspace(*actual)) actual++;
+            if (is_line_end(expected) || is_line_end(actual)) {
+                if (!is_line_end(expected) || !is_line_end(actual)) {
+                    return false;
+                }
+                break;
+            }
+            if (*expected++ != *actual++) {
+                return false;
+            }
+        }
+    }
+}
+
+enum batch_result {
+    batch_DONE,
+    batch_PASS,
+    batch_FAIL,
+    batch_SKIP, // NOTE: no expectation to compare with
+};
+
+struct batch_job {
+    char *name;
+    char *output;
+    size_t noutput;
+    enum batch_result result;
+    char *expected;
+};
+
+// NOTE: jobs [begin, end) of one worker; the owner takes from the front,
+// idle workers steal the back half
+struct batch_queue {
+    pthread_mutex_t lock;
+    int begin;
+    int end;
+};
+
+struct batch {
+    const char *dir;
+    const char *expect_dir;
+    const struct cpu *options;
+    bool stats;
+
+    struct batch_job *jobs;
+    int njobs;
+    struct batch_queue *queues;
+    int nqueues;
+};
+
+struct batch_worker {
+    struct batch *batch;
+    int index;
+    pthread_t thread;
+};
+
+static int
+batch_take_job(struct batch *batch, int index) {
+    struct batch_queue *own = batch->queues + index;
+
+    pthread_mutex_lock(&own->lock);
+    int result = (own->begin < own->end) ? own->begin++ : -1;
+    pthread_mutex_unlock(&own->lock);
+    if (result >= 0) {
+        return result;
+    }
+
+    for (int i = 1; i < batch->nqueues; i++) {
+        struct batch_queue *victim = batch->queues + (index + i) % batch->nqueues;
+
+        pthread_mutex_lock(&victim->lock);
+        int end = victim->end;
+        int begin = end - (end - victim->begin + 1) / 2;
+        if (begin < end) {
+            victim->end = begin;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (begin < end) {
+            pthread_mutex_lock(&own->lock);
+            own->begin = begin + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return begin;
+        }
+    }
+
+    return -1;
+}
+
+static void
+batch_run_job(struct batch *batch, struct cpu *cpu, struct batch_job *job) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", batch->dir, job->name);
+
+    if (batch->expect_dir) {
+        char expect_path[4096];
+        snprintf(expect_path, sizeof(expect_path), "%s/%s.txt", batch->expect_dir, job->name);
+        if (access(expect_path, R_OK) != 0) {
+            job->result = batch_SKIP;
+            return;
+        }
+        struct buffer expected = load_file(expect_path);
+        job->expected = malloc(expected.ndata + 1);
+        assert(job->expected);
+        memcpy(job->expected, expected.data, expected.ndata);
+        job->expected[expected.ndata] = '\0';
+        free_buffer(&expected);
+    }
+
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->powered = batch->options->powered;
+    cpu->fast = batch->options->fast;
+    cpu->use_jit = batch->options->use_jit;
+    cpu->print_ip = batch->options->print_ip;
+    cpu->load_segment = batch->options->load_segment;
+    cpu->clocks = batch->options->clocks;
+    cpu->bus_8088 = batch->options->bus_8088;
+    if (job->expected) {
+        // NOTE: expectations record ip and clocks only when the listing was run with them
+        cpu->print_ip = strstr(job->expected, "ip:") != NULL;
+        cpu->clocks = strstr(job->expected, "Clocks:") != NULL;
+    }
+
+    cpu->trace.out = open_memstream(&job->output, &job->noutput);
+    assert(cpu->trace.out);
+
+    struct buffer asm_data = load_file(path);
+    if (cpu->powered && !cpu_image_fits(cpu, asm_data.ndata)) {
+        fprintf(cpu->trace.out, "'%s' does not fit in a code segment at 0x%x\n", path, cpu->load_segment);
+    } else {
+        cpu_simulate(cpu, path, asm_data, batch->stats);
+    }
+    free_buffer(&asm_data);
+    fclose(cpu->trace.out);
+    cpu->trace.out = NULL;
+
+    job->result = batch_DONE;
+}
+
+static void *
+batch_worker_main(void *arg) {
+    struct batch_worker *worker = arg;
+    struct batch *batch = worker->batch;
+
+    // NOTE: struct cpu embeds the whole 1 MiB address space
+    struct cpu *cpu = malloc(sizeof(*cpu));
+    assert(cpu);
+
+    for (int job; (job = batch_take_job(batch, worker->index)) >= 0; ) {
+        batch_run_job(batch, cpu, batch->jobs + job);
+    }
+
+    free(cpu);
+    return NULL;
+}
+
+static int
+compare_job_names(const void *a, const void *b) {
+    const struct batch_job *x = a;
+    const struct batch_job *y = b;
+    return strcmp(x->name, y->name);
+}
+
+// NOTE: simulate every file in dir in parallel, print results in name order
+static int
+batch_run(const char *dir, const char *expect_dir, const struct cpu *options, bool stats) {
+    struct batch batch = {
+        .dir = dir,
+        .expect_dir = expect_dir,
+        .options = options,
+        .stats = stats,
+    };
+
+    DIR *handle = opendir(dir);
+    if (!handle) {
+        fprintf(stderr, "Cannot open directory '%s'\n", dir);
+        return 1;
+    }
+    int capacity = 0;
+    for (struct dirent *entry; (entry = readdir(handle)); ) {
+        if (entry->d_name[0] == '.' || (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)) {
+            continue;
+        }
+        if (batch.njobs == capacity) {
+            capacity = (capacity) ? capacity * 2 : 64;
+            batch.jobs = realloc(batch.jobs, capacity * sizeof(*batch.jobs));
+            assert(batch.jobs);
+        }
+        batch.jobs[batch.njobs++] = (struct batch_job){.name = strdup(entry->d_name)};
+    }
+    closedir(handle);
+    qsort(batch.jobs, batch.njobs, sizeof(*batch.jobs), compare_job_names);
+
+    long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+    batch.nqueues = (ncores < 1) ? 1 : (ncores < batch.njobs) ? ncores : (batch.njobs ? batch.njobs : 1);
+    batch.queues = calloc(batch.nqueues, sizeof(*batch.queues));
+    struct batch_worker *workers = calloc(batch.nqueues, sizeof(*workers));
+    assert(batch.queues && workers);
+    for (int i = 0; i < batch.nqueues; i++) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].begin = (u64)batch.njobs * i / batch.nqueues;
+        batch.queues[i].end = (u64)batch.njobs * (i + 1) / batch.nqueues;
+    }
+
+    for (int i = 0; i < batch.nqueues; i++) {
+        workers[i] = (struct batch_worker){.batch = &batch, .index = i};
+        int error = pthread_create(&workers[i].thread, NULL, batch_worker_main, workers + i);
+        assert(!error);
+    }
+    for (int i = 0; i < batch.nqueues; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    int npassed = 0;
+    int nfailed = 0;
+    int nskipped = 0;
+    for (int i = 0; i < batch.njobs; i++) {
+        struct batch_job *job = batch.jobs + i;
+        if (job->result == batch_SKIP) {
+            nskipped++;
+        } else if (!expect_dir) {
+            fwrite(job->output, 1, job->noutput, stdout);
+        } else {
+            const char *expected = job->expected;
+            const char *actual = job->output;
+            if (options->fast) {
+                // NOTE: only the tracing engine prints ops, compare final state
+                const char *expected_final = strstr(expected, "Final registers");
+                const char *actual_final = strstr(actual, "Final registers");
+                expected = (expected_final) ? expected_final : "";
+                actual = (actual_final) ? actual_final : "";
+            }
+
+            const char *expected_line;
+            const char *actual_line;
+            if (outputs_match(expected, actual, &expected_line, &actual_line)) {
+                job->result = batch_PASS;
+                npassed++;
+                printf("ok %s\n", job->name);
+            } else {
+                job->result = batch_FAIL;
+                nfailed++;
+                printf("FAIL %s\n", job->name);
+                printf("\texpected: %.*s\n", (int)(strchrnul(expected_line, '\n') - expected_line), expected_line);
+                printf("\tactual:   %.*s\n", (int)(strchrnul(actual_line, '\n') - actual_line), actual_line);
+            }
+        }
+
+        free(job->name);
+        free(job->output);
+        free(job->expected);
+    }
+    if (expect_dir) {
+        printf("%d passed, %d failed, %d without expectation\n", npassed, nfailed, nskipped);
+    }
+
+    for (int i = 0; i < batch.nqueues; i++) {
+        pthread_mutex_destroy(&batch.queues[i].lock);
+    }
+    free(workers);
+    free(batch.queues);
+    free(batch.jobs);
+
+    return (nfailed) ? 1 : 0;
+}
+
+// NOTE: "cx==0" or "ax!=0x10", any word register
+static bool
+parse_condition(const char *text, struct condition *condition) {
+    for (enum reg reg = 0; reg < reg_num; reg++) {
+        const char *name = reg_name(reg, 1);
+        size_t length = strlen(name);
+        if (strncmp(text, name, length) != 0) {
+            continue;
+        }
+        const char *op = text + length;
+        if (strncmp(op, "==", 2) != 0 && strncmp(op, "!=", 2) != 0) {
+            return false;
+        }
+        char *end;
+        unsigned long value = strtoul(op + 2, &end, 0);
+        if (op[2] == '\0' || *end || value > 0xffff) {
+            return false;
+        }
+        *condition = (struct condition){.reg = reg, .not_equal = op[0] == '!', .value = value};
+        return true;
+    }
+    return false;
+}
+
+int
+main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        exit(0);
+    }
+
+    if (strcmp(argv[1], "-disasm-selftest") == 0) {
+        return disasm_selftest((argc > 2) ? strtoull(argv[2], NULL, 0) : 1);
+    }
+
+    if (strcmp(argv[1], "-render-trace") == 0) {
+        if (argc != 3) {
+            usage(argv[0]);
+            exit(0);
+        }
+        return render_trace(argv[2]);
+    }
+
+    struct cpu cpu = {.trace.out = stdout};
+    const char *binary_trace_path = NULL;
+    const char *profile_path = NULL;
+    bool profile_collapsed = false;
+    const char *snapshot_path = NULL;
+    const char *dump_path = NULL;
+    bool resume = false;
+    bool bench = false;
+    bool stats = false;
+    bool bench_engines = false;
+    bool bench_kernel = false;
+    bool stream = false;
+    int disasm_threads = -1; // NOTE: -1 - serial
+    u32 chunk_size = STREAM_CHUNK_SIZE;
+    const char *batch_dir = NULL;
+    const char *expect_dir = NULL;
+    int first_option = 2;
+    if (strcmp(argv[1], "-batch") == 0) {
+        if (argc < 3) {
+            usage(argv[0]);
+            exit(0);
+        }
+        batch_dir = argv[2];
+        first_option = 3;
+    }
+    for (int i = first_option; i < argc; i++) {
+        if (strcmp(argv[i], "-exec") == 0) {
+            cpu.powered = true;
+        } else if (strcmp(argv[i], "-exec-fast") == 0) {
+            cpu.powered = true;
+            cpu.fast = true;
+        } else if (strcmp(argv[i], "-exec-jit") == 0) {
+            cpu.powered = true;
+            cpu.fast = true;
+            cpu.use_jit = true;
+        } else if (strcmp(argv[i], "-print-ip") == 0) {
+            cpu.print_ip = true;
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            stats = true;
+        } else if (strcmp(argv[i], "-clocks") == 0) {
+            cpu.clocks = true;
+        } else if (strcmp(argv[i], "-8088") == 0) {
+            cpu.bus_8088 = true;
+        } else if (strcmp(argv[i], "-profile") == 0 && !batch_dir) {
+            cpu.profiling = true;
+        } else if (strcmp(argv[i], "-profile-csv") == 0 && !batch_dir && i + 1 < argc) {
+            cpu.profiling = true;
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "-profile-collapsed") == 0 && !batch_dir && i + 1 < argc) {
+            cpu.profiling = true;
+            profile_path = argv[++i];
+            profile_collapsed = true;
+        } else if (strcmp(argv[i], "-bench-decode") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "-bench-exec") == 0) {
+            bench_engines = true;
+        } else if (strcmp(argv[i], "-bench-kernels") == 0) {
+            bench_kernel = true;
+        } else if (strcmp(argv[i], "-disasm-parallel") == 0 && !batch_dir && i + 1 < argc) {
+            char *end;
+            long nthreads = strtol(argv[++i], &end, 0);
+            if (*end || nthreads < 0 || nthreads > 1024) {
+                usage(argv[0]);
+                exit(0);
+            }
+            disasm_threads = nthreads;
+        } else if (strcmp(argv[i], "-disasm-stream") == 0 && !batch_dir) {
+            stream = true;
+        } else if (strcmp(argv[i], "-chunk-size") == 0 && !batch_dir && i + 1 < argc) {
+            char *end;
+            unsigned long size = strtoul(argv[++i], &end, 0);
+            if (*end || size == 0 || size > (1 << 30)) {
+                usage(argv[0]);
+                exit(0);
+            }
+            chunk_size = size;
+        } else if (strcmp(argv[i], "-load-segment") == 0 && i + 1 < argc) {
+            char *end;
+            unsigned long segment = strtoul(argv[++i], &end, 0);
+            if (*end || segment > 0xffff) {
+                usage(argv[0]);
+                exit(0);
+            }
+            cpu.load_segment = segment;
+        } else if (strcmp(argv[i], "-stop-after") == 0 && !batch_dir && i + 1 < argc) {
+            char *end;
+            cpu.stop_after = strtoull(argv[++i], &end, 0);
+            if (*end || cpu.stop_after == 0) {
+                usage(argv[0]);
+                exit(0);
+            }
+        } else if (strcmp(argv[i], "-snapshot") == 0 && !batch_dir && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "-memory-diff") == 0 && !batch_dir) {
+            cpu.memory_diff = true;
+        } else if (strcmp(argv[i], "-dump-memory") == 0 && !batch_dir && i + 1 < argc) {
+            dump_path = argv[++i];
+        } else if (strcmp(argv[i], "-resume") == 0 && !batch_dir) {
+            resume = true;
+        } else if (strcmp(argv[i], "-break") == 0 && !batch_dir && i + 1 < argc) {
+            char *end;
+            unsigned long ip = strtoul(argv[++i], &end, 0);
+            if (*end || ip > 0xffff) {
+                usage(argv[0]);
+                exit(0);
+            }
+            stops_add_breakpoint(&cpu.stops, ip);
+        } else if (strcmp(argv[i], "-watch") == 0 && !batch_dir && i + 1 < argc) {
+            struct stops *stops = &cpu.stops;
+            char *end;
+            unsigned long address = strtoul(argv[++i], &end, 0);
+            unsigned long size = (*end == ':') ? strtoul(end + 1, &end, 0) : 1;
+            if (*end || size == 0 || size > WATCHPOINT_MAX_SIZE || address + size > sizeof(cpu.memory) ||
+                stops->nwatchpoints == MAX_WATCHPOINTS) {
+                usage(argv[0]);
+                exit(0);
+            }
+            stops->watchpoints[stops->nwatchpoints++] = (struct watchpoint){.address = address, .size = size};
+        } else if (strcmp(argv[i], "-until") == 0 && !batch_dir && i + 1 < argc) {
+            struct stops *stops = &cpu.stops;
+            if (stops->nconditions == MAX_CONDITIONS || !parse_condition(argv[++i], &stops->conditions[stops->nconditions])) {
+                usage(argv[0]);
+                exit(0);
+            }
+            stops->nconditions++;
+        } else if (strcmp(argv[i], "-trace-bin") == 0 && !batch_dir && i + 1 < argc) {
+            binary_trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-expect") == 0 && batch_dir && i + 1 < argc) {
+            expect_dir = argv[++i];
+        } else {
+            usage(argv[0]);
+            exit(0);
+        }
+    }
+
+    if (batch_dir) {
+        return batch_run(batch_dir, expect_dir, &cpu, stats);
+    }
+
+    if (stream) {
+        if (cpu.powered || bench || bench_engines || bench_kernel) {
+            usage(argv[0]);
+            exit(0);
+        }
+        return disasm_stream(argv[1], chunk_size);
+    }
+
+    if (binary_trace_path && !(cpu.powered && !cpu.fast)) {
+        fprintf(stderr, "-trace-bin needs -exec\n");
+        exit(1);
+    }
+
+    // NOTE: clocks are estimated per op, which only the plain interpreter sees
+    if ((cpu.clocks || cpu.bus_8088) && !(cpu.powered && !cpu.fast && cpu.clocks && !binary_trace_path)) {
+        fprintf(stderr, "-clocks needs -exec without -trace-bin, -8088 needs -clocks\n");
+        exit(1);
+    }
+
+    if (stops_any(&cpu.stops) && !(cpu.powered && !cpu.fast)) {
+        fprintf(stderr, "-break, -watch and -until need -exec\n");
+        exit(1);
+    }
+
+    if (cpu.profiling && !(cpu.powered && !cpu.fast)) {
+        fprintf(stderr, "-profile needs -exec\n");
+        exit(1);
+    }
+
+    if ((cpu.stop_after || snapshot_path || resume || cpu.memory_diff || dump_path) && !cpu.powered) {
+        fprintf(stderr, "-stop-after, -snapshot, -resume, -memory-diff and -dump-memory need -exec, -exec-fast or -exec-jit\n");
+        exit(1);
+    }
+
+    const char *bin_path = argv[1];
+    struct buffer asm_data = {};
+    if (resume) {
+        if (bench || bench_engines || bench_kernel || cpu.load_segment) {
+            usage(argv[0]);
+            exit(0);
+        }
+        struct snapshot snapshot;
+        if (!snapshot_read(bin_path, &snapshot)) {
+            fprintf(stderr, "'%s' is not a snapshot\n", bin_path);
+            exit(1);
+        }
+        cpu_restore_snapshot(&cpu, &snapshot);
+        snapshot_free(&snapshot);
+    } else {
+        asm_data = load_file(bin_path);
+    }
+    dbg(asm_data);
+
+    // NOTE: -bench-exec and -bench-kernels run the image too
+    if ((cpu.powered || bench_engines || bench_kernel) && !resume && !cpu_image_fits(&cpu, asm_data.ndata)) {
+        fprintf(stderr, "'%s' does not fit in a code segment at 0x%x\n", bin_path, cpu.load_segment);
+        exit(1);
+    }
+
+    if (bench || bench_engines || bench_kernel) {
+        if (bench) {
+            bench_decode(bin_path, asm_data);
+        }
+        if (bench_engines) {
+            bench_exec(bin_path, asm_data);
+        }
+        if (bench_kernel) {
+            bench_kernels(bin_path, asm_data);
+        }
+        free_buffer(&asm_data);
+        return 0;
+    }
+
+    if (disasm_threads >= 0) {
+        if (cpu.powered) {
+            usage(argv[0]);
+            exit(0);
+        }
+        bool ok = disasm_parallel(bin_path, asm_data, disasm_threads, &cpu.trace);
+        trace_close(&cpu.trace);
+        free_buffer(&asm_data);
+        return (ok) ? 0 : 1;
+    }
+
+
+    if (binary_trace_path) {
+        cpu.binary_trace.out = fopen(binary_trace_path, "wb");
+        if (!cpu.binary_trace.out) {
+            fprintf(stderr, "Cannot open '%s'\n", binary_trace_path);
+            exit(1);
+        }
+    }
+
+    cpu_simulate(&cpu, bin_path, asm_data, stats);
+
+    if (dump_path && !cpu_dump_memory(&cpu, dump_path)) {
+        fprintf(stderr, "Cannot write '%s'\n", dump_path);
+        exit(1);
+    }
+
+    if (snapshot_path) {
+        struct snapshot snapshot = cpu_save_snapshot(&cpu);
+        bool ok = snapshot_write(&snapshot, snapshot_path);
+        snapshot_free(&snapshot);
+        if (!ok) {
+            fprintf(stderr, "Cannot write '%s'\n", snapshot_path);
+            exit(1);
+        }
+    }
+
+    if (profile_path && !cpu_write_profile(&cpu, bin_path, profile_path, profile_collapsed)) {
+        fprintf(stderr, "Cannot write '%s'\n", profile_path);
+        exit(1);
+    }
+    profile_free(&cpu.profile);
+
+    if (cpu.binary_trace.out) {
+        fclose(cpu.binary_trace.out);
+    }
+
+    free_buffer(&asm_data);
+    return (cpu.fault) ? 1 : 0;
+}
+#endif
@@ -1,10 +1,14 @@
-typedef unsigned char u8;
-typedef unsigned short u16;
-typedef signed char i8;
-typedef signed short i16;
-typedef unsigned short u16;
+#pragma once
 
-#define len(a) (sizeof(a)/sizeof(0[a]))
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "../basic.h"
+#include "libc8086.h"
+
+typedef int8_t i8;
+typedef int16_t i16;
 
 #define DEBUG 0
 
@@ -24,19 +28,6 @@ struct buffer {
     int ndata;
 };
 
-enum reg {
-    reg_AX,
-    reg_CX,
-    reg_DX,
-    reg_BX,
-    reg_SP,
-    reg_BP,
-    reg_SI,
-    reg_DI,
-
-    reg_num,
-};
-
 enum op_type {
     op_UNKNOWN,
 
@@ -45,6 +36,8 @@ enum op_type {
     op_MOV_IMM_TO_REG,
     op_MOV_MEM_TO_ACC,
     op_MOV_ACC_TO_MEM,
+    op_MOV_RM_TO_SREG,
+    op_MOV_SREG_TO_RM,
 
     op_ADD,
     op_ADD_IMM_TO_RM,
@@ -78,17 +71,21 @@ enum op_type {
     op_LOOPZ,
     op_LOOPNZ,
     op_JCXZ,
+
+    op_num,
 };
 
+// NOTE: packed into 8 bytes, prog and the decode cache hold one per op
 struct op {
-    enum op_type type;
-    u8 d; // 0 - src in reg, 1 - dst in reg
-    u8 s; // sign extension
-    u8 w; // byte/word
-    u8 mod;
+    enum op_type type : 8;
+    u8 d : 1; // 0 - src in reg, 1 - dst in reg
+    u8 s : 1; // sign extension
+    u8 w : 1; // byte/word
+    u8 mod : 2;
+    u8 segment : 3; // NOTE: sreg + 1 of an override prefix, 0 - default segment
 
-    enum reg reg;
-    enum reg rm;
+    enum reg reg : 4;
+    enum reg rm : 4;
     union {
         i8 disp_byte;
         i16 disp;
@@ -101,11 +98,80 @@ struct op {
     };
 };
 
+_Static_assert(sizeof(struct op) == 8, "struct op is expected to stay packed");
+
+// NOTE: decode cache entry, indexed by ip
+struct decoded {
+    struct op op;
+    u8 size; // NOTE: 0 - not decoded yet
+};
+
+struct cpu;
+
+typedef void (*exec_proc)(struct cpu *cpu, struct op op);
+
+struct block_op {
+    exec_proc proc;
+    struct op op;
+    u16 next_ip;
+};
+
+// NOTE: native code for a block, returns the host rflags
+typedef u64 (*jit_proc)(struct cpu *cpu);
+
+// NOTE: basic block compiled to threaded code for -exec-fast
+struct block {
+    u16 nops;
+    u16 ip;
+    u16 last_ip; // NOTE: start of the final op
+    u16 end_ip;
+
+    bool writes_memory; // NOTE: may store into its own code
+    u32 hits;
+    bool no_jit;
+    bool sets_flags;
+    u8 load_segments; // NOTE: 1 << sreg for every segment native code reads
+    u8 store_segments;
+    jit_proc native; // NOTE: -exec-jit, once the block is hot
+
+    struct block_op ops[];
+};
+
+#define JIT_HOT_COUNT 2
+
+// NOTE: executable buffer for -exec-jit, reused whenever blocks are flushed
+struct jit {
+    u8 *code;
+    u32 ncode;
+    u32 capacity;
+    u64 iterations; // NOTE: written by native code on exit
+    u32 ncompiled; // NOTE: blocks turned into native code, for -stats
+    const char *fallback; // NOTE: why jit_init gave up, the command line reports it
+};
+
+#define PROG_CHUNK_OPS 4096
+
+// NOTE: chunks are never moved or resized, so the program grows without copying
+struct prog_chunk {
+    struct prog_chunk *next;
+    u32 nops;
+    struct op ops[PROG_CHUNK_OPS];
+};
+
+// NOTE: every op decoded by a run, in decode order
 struct prog {
-    struct op ops[128];
-    int nops;
+    struct prog_chunk *first;
+    struct prog_chunk *last;
+    u64 nops;
 };
 
+static inline const char *
+sreg_name(enum sreg sreg) {
+    static const char *names[] = {"es", "cs", "ss", "ds"};
+    assert(sreg < sreg_num);
+    return names[sreg];
+}
+
 static inline const char *
 reg_name(enum reg reg, u8 word) {
     static const char *word_names[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
@@ -115,26 +181,175 @@ reg_name(enum reg reg, u8 word) {
     return result;
 }
 
-enum flags {
-    flags_CARRY = 0x1,
-    flags_PARITY = 0x2,
-    flags_AUX_CARRY = 0x4,
-    flags_ZERO = 0x8,
-    flags_SIGN = 0x10,
-    flags_OVERFLOW = 0x20,
+#define TRACE_CAPACITY (1 << 20)
+
+// NOTE: output buffered in TRACE_CAPACITY chunks, data is allocated on first use
+struct trace {
+    FILE *out;
+    trace_write_proc write; // NOTE: used instead of out when set
+    void *user;
+    u8 *data;
+    u32 size;
+    u64 nwritten; // NOTE: bytes flushed to out so far
+};
+
+enum trace_kind {
+    trace_OP = 1,
+    trace_SKIPPED_OP, // NOTE: decoded but not simulated
+    trace_FINAL,
+};
+
+// NOTE: -clocks estimate for one op, prefetch queue and wait states are not modeled
+struct clocks {
+    u16 base;
+    u16 ea; // NOTE: effective address calculation
+    u16 penalty; // NOTE: 4 per word transfer, on the 8086 only at odd addresses
+};
+
+// NOTE: one executed op, printed as a line of text or a binary trace record
+struct trace_record {
+    enum trace_kind kind;
+    u16 ip;
+    u16 next_ip;
+    u8 size;
+    u8 bytes[7];
+    enum flags old_flags;
+    enum flags new_flags;
+    u16 old_regs[reg_num];
+    u16 new_regs[reg_num];
+    u16 old_sregs[sreg_num];
+    u16 new_sregs[sreg_num];
+    struct clocks clocks; // NOTE: base 0 - not estimated
+    u64 total_clocks;
+};
+
+enum lazy_op {
+    lazy_NONE, // NOTE: cpu->flags is up to date
+    lazy_ADD,
+    lazy_SUB,
+};
+
+// NOTE: operands of the last flag-setting op, see cpu_flags
+struct lazy_flags {
+    enum lazy_op op;
+    u16 a;
+    u16 b;
+    u32 result;
+    u8 w;
+};
+
+#define MEMORY_MASK 0xfffff
+
+// NOTE: -profile counters, flat arrays so counting is an increment;
+// allocated only while profiling, ip_counts is NULL otherwise
+struct profile {
+    u64 *ip_counts; // NOTE: nbytes entries
+    u64 *taken; // NOTE: nbytes entries, conditional jumps only
+    u64 *not_taken;
+    u32 *reads; // NOTE: MEMORY_MASK + 1 entries, by the address of the access
+    u32 *writes;
+    u64 op_counts[op_num];
+    u64 op_cycles[op_num]; // NOTE: host timestamp counter cycles inside the exec proc
+};
+
+#define SNAPSHOT_PAGE_SHIFT 8
+#define SNAPSHOT_PAGE_SIZE (1 << SNAPSHOT_PAGE_SHIFT)
+#define SNAPSHOT_NPAGES ((MEMORY_MASK + 1) >> SNAPSHOT_PAGE_SHIFT)
+
+// NOTE: state a run can resume from; memory starts zeroed, so only the pages
+// written since then are kept
+struct snapshot {
+    u16 regs[reg_num];
+    u16 sregs[sreg_num];
+    u16 ip;
+    enum flags flags;
+    u16 load_segment;
+    u32 nbytes;
+
+    u32 npages;
+    u16 *pages; // NOTE: page numbers, ascending
+    u8 *data; // NOTE: npages * SNAPSHOT_PAGE_SIZE bytes
+};
+
+#define MAX_WATCHPOINTS 8
+#define WATCHPOINT_MAX_SIZE 64
+#define MAX_CONDITIONS 8
+
+enum stop_reason {
+    stop_NONE,
+    stop_BREAKPOINT, // NOTE: before the op at a breakpoint
+    stop_WATCHPOINT, // NOTE: after an op that changed a watched range
+    stop_CONDITION, // NOTE: after an op that made a condition true
+};
+
+struct watchpoint {
+    u32 address; // NOTE: physical
+    u32 size;
+    u8 old[WATCHPOINT_MAX_SIZE];
+};
+
+struct condition {
+    enum reg reg;
+    bool not_equal;
+    u16 value;
+};
+
+// NOTE: where an interpreter run stops early, any of them switches cpu_run
+// to the checked loop, the plain one never looks at this
+struct stops {
+    u64 breakpoints[0x10000 / 64]; // NOTE: a bit per ip
+    u32 nbreakpoints;
+    struct watchpoint watchpoints[MAX_WATCHPOINTS];
+    u32 nwatchpoints;
+    struct condition conditions[MAX_CONDITIONS];
+    u32 nconditions;
+
+    enum stop_reason reason; // NOTE: why the last run stopped
+    u32 which; // NOTE: index of the watchpoint or condition
 };
 
 struct cpu {
     bool powered;
     enum reg regs[reg_num];
     enum flags flags;
+    struct lazy_flags lazy;
+    u16 sregs[sreg_num];
 
     u8 memory[1024*1024];
+    u64 dirty[SNAPSHOT_NPAGES / 64]; // NOTE: a bit per page written since power on
+    bool resumed; // NOTE: memory and registers came from a snapshot, cpu_run loads nothing
+    bool memory_diff; // NOTE: -memory-diff, report the rows that changed after the registers
+    struct snapshot memory_baseline; // NOTE: dirty pages as cpu_run found them, for memory_diff
 
     u16 last_ip; // NOTE: beginning of current instruction
     u16 ip;
-    u8 *instructions;
-    u16 nbytes; // NOTE: number of bytes actually read into memory
+    u16 load_segment; // NOTE: the image is copied to load_segment * 16, cs
+    u8 *instructions; // NOTE: the image inside memory
+    u32 nbytes; // NOTE: image bytes reachable by ip
+
+    struct decoded *decoded; // NOTE: nbytes entries, NULL when not executing
+    u64 decode_hits;
+    u64 decode_misses;
 
+    struct block **blocks; // NOTE: nbytes entries, only for -exec-fast
+    bool blocks_stale;
+    struct jit jit;
+
+    const char *fault; // NOTE: an op c8086 cannot simulate, the run stopped with ip at it
+
+    u64 nexecuted;
+    u64 stop_after; // NOTE: 0 - run until ip leaves the image, fast engines stop between blocks
+    u64 total_clocks;
+    struct profile profile;
+
+    struct trace trace; // NOTE: trace, disassembly and final registers
+    struct trace binary_trace; // NOTE: -trace-bin, replaces the op lines when out is set
     bool print_ip;
+    bool fast;
+    bool use_jit;
+    bool clocks;
+    bool profiling; // NOTE: -profile, counters are allocated by cpu_run
+    bool bus_8088; // NOTE: 8-bit bus, every word transfer takes two
+
+    struct stops stops; // NOTE: -break, -watch and -until
 };
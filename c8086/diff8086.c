@@ -0,0 +1,1013 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../basic.h"
+#include "c8086.h"
+
+// NOTE: differential testing of the core against the reference interpreter
+// below. Random programs over the ops c8086 simulates run one op at a time
+// through the library and the reference, registers, segments, ip and flags
+// are compared after every op and the written memory at the end. With
+// -engine the same programs also run through the threaded code and the JIT,
+// which are compared on the final state only. A failing program is shrunk
+// item by item and written out for `c8086 FILE -exec`.
+//
+// The reference is deliberately simple and shares nothing with c8086.c: it
+// decodes raw bytes and computes flags eagerly. It follows c8086 where the
+// 8086 is not modelled, a word at offset 0xffff spills into the next
+// physical byte instead of wrapping inside the segment.
+
+// NOTE: code sits above everything segment 0 can reach, and segments loaded
+// by the programs start above the code, so only item_PATCH stores hit the
+// program, through cs
+#define CODE_SEGMENT 0x1100
+#define DATA_SEGMENT_MIN 0x2000
+#define DATA_SEGMENT_MAX 0xe000
+
+#define MAX_ITEMS 48
+#define MAX_LOOP_ITEMS 8
+#define ITEM_MAX_SIZE 10
+#define MAX_STEPS 100000
+
+enum item_kind {
+    item_OPS, // NOTE: one op, or mov reg, imm; mov sreg, reg
+    item_JNZ, // NOTE: forward, over skip items
+    item_LOOP_BEGIN, // NOTE: mov cx, count
+    item_LOOP_END, // NOTE: sub cx, 1; jnz back to the op after LOOP_BEGIN
+    item_PATCH, // NOTE: a store through cs into the immediate of a mov reg, imm16
+};
+
+struct item {
+    enum item_kind kind;
+    u8 size;
+    u8 bytes[ITEM_MAX_SIZE];
+    u8 skip;
+    u8 count;
+    u8 pick; // NOTE: item_PATCH, which mov reg, imm16, bit 7 its high byte
+    u8 addr_at; // NOTE: item_PATCH, offset of the address program_assemble fills in
+};
+
+struct program {
+    struct item items[MAX_ITEMS];
+    u32 nitems;
+};
+
+struct gen {
+    u64 state;
+};
+
+// NOTE: perf.h defines its globals, it cannot be linked next to the library
+static f64
+seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static u32
+gen_random(struct gen *g, u32 n) {
+    u64 x = g->state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    g->state = x;
+    return (x >> 16) % n;
+}
+
+static void
+item_emit(struct item *item, u8 byte) {
+    assert(item->size < ITEM_MAX_SIZE);
+    item->bytes[item->size++] = byte;
+}
+
+static void
+item_emit_word(struct item *item, u16 word) {
+    item_emit(item, word);
+    item_emit(item, word >> 8);
+}
+
+// NOTE: a register an op may write, loop bodies keep cx, cl and ch intact
+static u8
+gen_dest_reg(struct gen *g, u8 w, bool in_loop) {
+    u8 reg;
+    do {
+        reg = gen_random(g, 8);
+    } while (in_loop && (reg == reg_CX || (!w && reg == reg_CX + 4)));
+    return reg;
+}
+
+// NOTE: mod/rm byte with a memory operand, its displacement and maybe a
+// segment override, cs is never overridden so stores stay out of the code
+static void
+gen_memory_operand(struct gen *g, struct item *item, u8 opcode, u8 reg) {
+    static const u8 prefixes[] = {0x26, 0x36, 0x3e};
+    if (!gen_random(g, 3)) {
+        item_emit(item, prefixes[gen_random(g, len(prefixes))]);
+    }
+    u8 mod = gen_random(g, 3);
+    u8 rm = gen_random(g, 8);
+    item_emit(item, opcode);
+    item_emit(item, (mod << 6) | (reg << 3) | rm);
+    if (mod == 0b01) {
+        item_emit(item, gen_random(g, 256));
+    } else if (mod == 0b10 || (mod == 0b00 && rm == 0b110)) {
+        item_emit_word(item, gen_random(g, 0x10000));
+    }
+}
+
+static void
+gen_register_operand(struct item *item, u8 opcode, u8 reg, u8 rm) {
+    item_emit(item, opcode);
+    item_emit(item, 0xc0 | (reg << 3) | rm);
+}
+
+static struct item
+gen_op(struct gen *g, bool in_loop) {
+    struct item result = {.kind = item_OPS};
+    struct item *item = &result;
+    u8 w = gen_random(g, 2);
+    bool memory = gen_random(g, 2);
+    switch (gen_random(g, 9)) {
+    case 0: {
+        // NOTE: mov r/m, reg and mov reg, r/m
+        u8 d = gen_random(g, 2);
+        if (memory) {
+            u8 reg = (d) ? gen_dest_reg(g, w, in_loop) : gen_random(g, 8);
+            gen_memory_operand(g, item, 0x88 | (d << 1) | w, reg);
+        } else if (d) {
+            gen_register_operand(item, 0x8a | w, gen_dest_reg(g, w, in_loop), gen_random(g, 8));
+        } else {
+            gen_register_operand(item, 0x88 | w, gen_random(g, 8), gen_dest_reg(g, w, in_loop));
+        }
+    } break;
+
+    case 1: {
+        gen_memory_operand(g, item, 0xc6 | w, 0);
+        if (w) {
+            item_emit_word(item, gen_random(g, 0x10000));
+        } else {
+            item_emit(item, gen_random(g, 256));
+        }
+    } break;
+
+    case 2: {
+        item_emit(item, 0xb0 | (w << 3) | gen_dest_reg(g, w, in_loop));
+        if (w) {
+            item_emit_word(item, gen_random(g, 0x10000));
+        } else {
+            item_emit(item, gen_random(g, 256));
+        }
+    } break;
+
+    case 3: {
+        // NOTE: mov al/ax, [addr] and back
+        static const u8 prefixes[] = {0x26, 0x36, 0x3e};
+        if (!gen_random(g, 3)) {
+            item_emit(item, prefixes[gen_random(g, len(prefixes))]);
+        }
+        item_emit(item, 0xa0 | (gen_random(g, 2) << 1) | w);
+        item_emit_word(item, gen_random(g, 0x10000));
+    } break;
+
+    case 4: {
+        // NOTE: add, sub, cmp between r/m and reg
+        static const u8 opcodes[] = {0x00, 0x28, 0x38};
+        u8 opcode = opcodes[gen_random(g, len(opcodes))];
+        bool store = opcode != 0x38;
+        u8 d = gen_random(g, 2);
+        if (memory) {
+            u8 reg = (d && store) ? gen_dest_reg(g, w, in_loop) : gen_random(g, 8);
+            gen_memory_operand(g, item, opcode | (d << 1) | w, reg);
+        } else {
+            u8 dest = (store) ? gen_dest_reg(g, w, in_loop) : gen_random(g, 8);
+            u8 other = gen_random(g, 8);
+            if (d) {
+                gen_register_operand(item, opcode | 0x2 | w, dest, other);
+            } else {
+                gen_register_operand(item, opcode | w, other, dest);
+            }
+        }
+    } break;
+
+    case 5: {
+        // NOTE: the 0x80 group, add, sub and cmp only
+        static const u8 kinds[] = {0b000, 0b101, 0b111};
+        u8 kind = kinds[gen_random(g, len(kinds))];
+        u8 opcode = (!w) ? 0x80 : (gen_random(g, 2)) ? 0x81 : 0x83;
+        if (memory) {
+            gen_memory_operand(g, item, opcode, kind);
+        } else {
+            u8 rm = (kind != 0b111) ? gen_dest_reg(g, w, in_loop) : gen_random(g, 8);
+            gen_register_operand(item, opcode, kind, rm);
+        }
+        if (opcode == 0x81) {
+            item_emit_word(item, gen_random(g, 0x10000));
+        } else {
+            item_emit(item, gen_random(g, 256));
+        }
+    } break;
+
+    case 6: {
+        static const u8 opcodes[] = {0x04, 0x2c, 0x3c};
+        item_emit(item, opcodes[gen_random(g, len(opcodes))] | w);
+        if (w) {
+            item_emit_word(item, gen_random(g, 0x10000));
+        } else {
+            item_emit(item, gen_random(g, 256));
+        }
+    } break;
+
+    case 7: {
+        // NOTE: mov r/m, sreg, cs included
+        if (memory) {
+            gen_memory_operand(g, item, 0x8c, gen_random(g, sreg_num));
+        } else {
+            gen_register_operand(item, 0x8c, gen_random(g, sreg_num), gen_dest_reg(g, 1, in_loop));
+        }
+    } break;
+
+    case 8: {
+        // NOTE: es, ss or ds through a register, only with a segment above the code
+        static const enum sreg writable[] = {sreg_ES, sreg_SS, sreg_DS};
+        u8 reg = gen_dest_reg(g, 1, in_loop);
+        item_emit(item, 0xb8 | reg);
+        item_emit_word(item, DATA_SEGMENT_MIN + gen_random(g, DATA_SEGMENT_MAX - DATA_SEGMENT_MIN + 1));
+        gen_register_operand(item, 0x8e, writable[gen_random(g, len(writable))], reg);
+    } break;
+    }
+    return result;
+}
+
+// NOTE: one of the ops with a memory destination, cs overridden and a direct
+// address; any value stored into an immediate still decodes
+static struct item
+gen_patch(struct gen *g) {
+    struct item result = {.kind = item_PATCH, .pick = gen_random(g, 256)};
+    struct item *item = &result;
+    u8 w = gen_random(g, 2);
+    item_emit(item, 0x2e);
+    switch (gen_random(g, 5)) {
+    case 0: {
+        item_emit(item, 0xc6 | w);
+        item_emit(item, 0x06);
+        item->addr_at = item->size;
+        item_emit_word(item, 0);
+        if (w) {
+            item_emit_word(item, gen_random(g, 0x10000));
+        } else {
+            item_emit(item, gen_random(g, 256));
+        }
+    } break;
+
+    case 1: {
+        item_emit(item, 0xa2 | w);
+        item->addr_at = item->size;
+        item_emit_word(item, 0);
+    } break;
+
+    case 2: {
+        // NOTE: add, sub r/m, reg
+        static const u8 opcodes[] = {0x00, 0x28};
+        item_emit(item, opcodes[gen_random(g, len(opcodes))] | w);
+        item_emit(item, 0x06 | (gen_random(g, 8) << 3));
+        item->addr_at = item->size;
+        item_emit_word(item, 0);
+    } break;
+
+    case 3: {
+        // NOTE: add, sub r/m, imm
+        static const u8 kinds[] = {0b000, 0b101};
+        u8 opcode = (!w) ? 0x80 : (gen_random(g, 2)) ? 0x81 : 0x83;
+        item_emit(item, opcode);
+        item_emit(item, 0x06 | (kinds[gen_random(g, len(kinds))] << 3));
+        item->addr_at = item->size;
+        item_emit_word(item, 0);
+        if (opcode == 0x81) {
+            item_emit_word(item, gen_random(g, 0x10000));
+        } else {
+            item_emit(item, gen_random(g, 256));
+        }
+    } break;
+
+    case 4: {
+        w = 1;
+        item_emit(item, 0x8c);
+        item_emit(item, 0x06 | (gen_random(g, sreg_num) << 3));
+        item->addr_at = item->size;
+        item_emit_word(item, 0);
+    } break;
+    }
+    if (w) {
+        // NOTE: a word covers the whole immediate, one byte further is the next op
+        result.pick &= 0x7f;
+    }
+    return result;
+}
+
+static struct item
+gen_item(struct gen *g, bool in_loop) {
+    if (!gen_random(g, 8)) {
+        return (struct item){.kind = item_JNZ, .skip = gen_random(g, 4)};
+    }
+    if (!gen_random(g, 16)) {
+        return gen_patch(g);
+    }
+    return gen_op(g, in_loop);
+}
+
+static void
+gen_program(struct gen *g, struct program *program) {
+    u32 nitems = 1 + gen_random(g, MAX_ITEMS);
+    program->nitems = 0;
+    while (program->nitems < nitems) {
+        u32 left = MAX_ITEMS - program->nitems;
+        if (left >= 3 && !gen_random(g, 6)) {
+            u32 nbody = gen_random(g, ((left - 2 < MAX_LOOP_ITEMS) ? left - 2 : MAX_LOOP_ITEMS) + 1);
+            program->items[program->nitems++] = (struct item){.kind = item_LOOP_BEGIN, .count = 1 + gen_random(g, 4)};
+            for (u32 i = 0; i < nbody; i++) {
+                program->items[program->nitems++] = gen_item(g, true);
+            }
+            program->items[program->nitems++] = (struct item){.kind = item_LOOP_END};
+        } else {
+            program->items[program->nitems++] = gen_item(g, false);
+        }
+    }
+}
+
+static u32
+item_size(const struct item *item) {
+    switch (item->kind) {
+    case item_OPS: return item->size;
+    case item_PATCH: return item->size;
+    case item_JNZ: return 2;
+    case item_LOOP_BEGIN: return 3;
+    case item_LOOP_END: return 5;
+    }
+    unreachable();
+    return 0;
+}
+
+// NOTE: mov reg, imm16 on its own, never the mov cx of a loop or the mov
+// before a mov sreg, so patching its immediate changes nothing but the value
+static bool
+item_is_patch_target(const struct item *item) {
+    return item->kind == item_OPS && item->size == 3 && (item->bytes[0] & 0xf8) == 0xb8;
+}
+
+// NOTE: a forward jnz lands on the first loop boundary it would cross, so it
+// never enters a loop body with cx unset; loop bodies stay within a short jump.
+// A patch without any target stores past the end of the code
+static u32
+program_assemble(const struct program *program, u8 *out) {
+    u32 offsets[MAX_ITEMS + 1];
+    offsets[0] = 0;
+    for (u32 i = 0; i < program->nitems; i++) {
+        offsets[i + 1] = offsets[i] + item_size(&program->items[i]);
+    }
+
+    u32 ntargets = 0;
+    for (u32 i = 0; i < program->nitems; i++) {
+        ntargets += item_is_patch_target(&program->items[i]);
+    }
+
+    u32 loop_start = 0;
+    for (u32 i = 0; i < program->nitems; i++) {
+        const struct item *item = &program->items[i];
+        u8 *at = out + offsets[i];
+        switch (item->kind) {
+        case item_OPS: memcpy(at, item->bytes, item->size); break;
+
+        case item_PATCH: {
+            u16 address = offsets[program->nitems];
+            if (ntargets) {
+                u32 n = (item->pick & 0x7f) % ntargets;
+                u32 target = 0;
+                while (!item_is_patch_target(&program->items[target]) || n--) {
+                    target++;
+                }
+                address = offsets[target] + 1 + (item->pick >> 7);
+            }
+            memcpy(at, item->bytes, item->size);
+            at[item->addr_at] = address;
+            at[item->addr_at + 1] = address >> 8;
+        } break;
+
+        case item_JNZ: {
+            u32 target = i + 1;
+            while (target < program->nitems && target < i + 1 + item->skip &&
+                   program->items[target].kind != item_LOOP_BEGIN && program->items[target].kind != item_LOOP_END) {
+                target++;
+            }
+            while (offsets[target] - offsets[i + 1] > 127) {
+                target--;
+            }
+            at[0] = 0x75;
+            at[1] = offsets[target] - offsets[i + 1];
+        } break;
+
+        case item_LOOP_BEGIN: {
+            at[0] = 0xb9;
+            at[1] = item->count;
+            at[2] = 0;
+            loop_start = offsets[i + 1];
+        } break;
+
+        case item_LOOP_END: {
+            at[0] = 0x83;
+            at[1] = 0xe9;
+            at[2] = 1;
+            at[3] = 0x75;
+            at[4] = (u8)(loop_start - offsets[i + 1]);
+            assert(offsets[i + 1] - loop_start <= 128);
+        } break;
+        }
+    }
+    return offsets[program->nitems];
+}
+
+// NOTE: the reference interpreter
+
+struct ref {
+    u16 regs[reg_num];
+    u16 sregs[sreg_num];
+    u16 ip;
+    enum flags flags;
+    u32 nbytes;
+    u8 *memory;
+    u32 *written; // NOTE: addresses stored to, to compare and clear them
+    u32 nwritten;
+    u32 capacity;
+};
+
+static u8
+ref_read_byte(struct ref *r, u32 address) {
+    return r->memory[address & MEMORY_MASK];
+}
+
+static void
+ref_write_byte(struct ref *r, u32 address, u8 value) {
+    address &= MEMORY_MASK;
+    r->memory[address] = value;
+    if (r->nwritten == r->capacity) {
+        r->capacity = (r->capacity) ? r->capacity * 2 : 1024;
+        r->written = realloc(r->written, r->capacity * sizeof(*r->written));
+        assert(r->written);
+    }
+    r->written[r->nwritten++] = address;
+}
+
+static u16
+ref_read(struct ref *r, u32 address, bool w) {
+    u16 value = ref_read_byte(r, address);
+    if (w) {
+        value |= ref_read_byte(r, address + 1) << 8;
+    }
+    return value;
+}
+
+static void
+ref_write(struct ref *r, u32 address, bool w, u16 value) {
+    ref_write_byte(r, address, value);
+    if (w) {
+        ref_write_byte(r, address + 1, value >> 8);
+    }
+}
+
+// NOTE: al, cl, dl, bl, ah, ch, dh, bh for bytes
+static u16
+ref_get_reg(struct ref *r, u8 reg, bool w) {
+    if (w) {
+        return r->regs[reg];
+    }
+    return (reg < 4) ? r->regs[reg] & 0xff : r->regs[reg - 4] >> 8;
+}
+
+static void
+ref_set_reg(struct ref *r, u8 reg, bool w, u16 value) {
+    if (w) {
+        r->regs[reg] = value;
+    } else if (reg < 4) {
+        r->regs[reg] = (r->regs[reg] & 0xff00) | (value & 0xff);
+    } else {
+        r->regs[reg - 4] = (r->regs[reg - 4] & 0x00ff) | ((value & 0xff) << 8);
+    }
+}
+
+static u8
+ref_fetch(struct ref *r) {
+    return ref_read_byte(r, (CODE_SEGMENT << 4) + r->ip++);
+}
+
+static u16
+ref_fetch_word(struct ref *r) {
+    u16 low = ref_fetch(r);
+    return low | (ref_fetch(r) << 8);
+}
+
+struct ref_operand {
+    bool is_reg;
+    u8 reg;
+    u32 address;
+};
+
+static struct ref_operand
+ref_fetch_modrm(struct ref *r, int segment, u8 *reg) {
+    u8 modrm = ref_fetch(r);
+    u8 mod = modrm >> 6;
+    u8 rm = modrm & 7;
+    *reg = (modrm >> 3) & 7;
+    if (mod == 3) {
+        return (struct ref_operand){.is_reg = true, .reg = rm};
+    }
+
+    u16 offset = 0;
+    bool bp_based = false;
+    if (mod == 0 && rm == 6) {
+        offset = ref_fetch_word(r);
+    } else {
+        switch (rm) {
+        case 0: offset = r->regs[reg_BX] + r->regs[reg_SI]; break;
+        case 1: offset = r->regs[reg_BX] + r->regs[reg_DI]; break;
+        case 2: offset = r->regs[reg_BP] + r->regs[reg_SI]; bp_based = true; break;
+        case 3: offset = r->regs[reg_BP] + r->regs[reg_DI]; bp_based = true; break;
+        case 4: offset = r->regs[reg_SI]; break;
+        case 5: offset = r->regs[reg_DI]; break;
+        case 6: offset = r->regs[reg_BP]; bp_based = true; break;
+        case 7: offset = r->regs[reg_BX]; break;
+        }
+        if (mod == 1) {
+            offset += (i8)ref_fetch(r);
+        } else if (mod == 2) {
+            offset += ref_fetch_word(r);
+        }
+    }
+    if (segment < 0) {
+        segment = (bp_based) ? sreg_SS : sreg_DS;
+    }
+    return (struct ref_operand){.address = ((u32)r->sregs[segment] << 4) + offset};
+}
+
+static u16
+ref_get(struct ref *r, struct ref_operand operand, bool w) {
+    return (operand.is_reg) ? ref_get_reg(r, operand.reg, w) : ref_read(r, operand.address, w);
+}
+
+static void
+ref_set(struct ref *r, struct ref_operand operand, bool w, u16 value) {
+    if (operand.is_reg) {
+        ref_set_reg(r, operand.reg, w, value);
+    } else {
+        ref_write(r, operand.address, w, value);
+    }
+}
+
+// NOTE: kind 0 - add, 5 - sub, 7 - cmp, as in the 0x80 group
+static u16
+ref_arith(struct ref *r, u8 kind, u16 a, u16 b, bool w) {
+    u32 mask = (w) ? 0xffff : 0xff;
+    u32 sign = (w) ? 0x8000 : 0x80;
+    a &= mask;
+    b &= mask;
+    bool sub = kind != 0;
+    u32 wide = (sub) ? (u32)a - b : (u32)a + b;
+    u16 result = wide & mask;
+
+    enum flags flags = 0;
+    if ((sub) ? a < b : wide > mask) {
+        flags |= flags_CARRY;
+    }
+    int ones = 0;
+    for (int i = 0; i < 8; i++) {
+        ones += (result >> i) & 1;
+    }
+    if (ones % 2 == 0) {
+        flags |= flags_PARITY;
+    }
+    if ((sub) ? (a & 0xf) < (b & 0xf) : (a & 0xf) + (b & 0xf) > 0xf) {
+        flags |= flags_AUX_CARRY;
+    }
+    if (result == 0) {
+        flags |= flags_ZERO;
+    }
+    if (result & sign) {
+        flags |= flags_SIGN;
+    }
+    bool a_negative = a & sign;
+    bool b_negative = b & sign;
+    bool result_negative = result & sign;
+    if ((sub) ? (a_negative != b_negative && result_negative != a_negative)
+              : (a_negative == b_negative && result_negative != a_negative)) {
+        flags |= flags_OVERFLOW;
+    }
+    r->flags = flags;
+    return result;
+}
+
+static void
+ref_step(struct ref *r) {
+    int segment = -1;
+    u8 opcode = ref_fetch(r);
+    while (opcode == 0x26 || opcode == 0x2e || opcode == 0x36 || opcode == 0x3e) {
+        segment = (opcode >> 3) & 3;
+        opcode = ref_fetch(r);
+    }
+
+    bool w = opcode & 1;
+    u8 reg;
+    switch (opcode) {
+    case 0x88: case 0x89: case 0x8a: case 0x8b: {
+        struct ref_operand rm = ref_fetch_modrm(r, segment, &reg);
+        if (opcode & 2) {
+            ref_set_reg(r, reg, w, ref_get(r, rm, w));
+        } else {
+            ref_set(r, rm, w, ref_get_reg(r, reg, w));
+        }
+    } break;
+
+    case 0xc6: case 0xc7: {
+        struct ref_operand rm = ref_fetch_modrm(r, segment, &reg);
+        u16 value = (w) ? ref_fetch_word(r) : ref_fetch(r);
+        ref_set(r, rm, w, value);
+    } break;
+
+    case 0xb0 ... 0xbf: {
+        w = opcode & 8;
+        ref_set_reg(r, opcode & 7, w, (w) ? ref_fetch_word(r) : ref_fetch(r));
+    } break;
+
+    case 0xa0: case 0xa1: case 0xa2: case 0xa3: {
+        u32 address = ((u32)r->sregs[(segment < 0) ? sreg_DS : segment] << 4) + ref_fetch_word(r);
+        if (opcode & 2) {
+            ref_write(r, address, w, ref_get_reg(r, reg_AX, w));
+        } else {
+            ref_set_reg(r, reg_AX, w, ref_read(r, address, w));
+        }
+    } break;
+
+    case 0x8c: {
+        struct ref_operand rm = ref_fetch_modrm(r, segment, &reg);
+        ref_set(r, rm, true, r->sregs[reg & 3]);
+    } break;
+
+    case 0x8e: {
+        struct ref_operand rm = ref_fetch_modrm(r, segment, &reg);
+        r->sregs[reg & 3] = ref_get(r, rm, true);
+    } break;
+
+    case 0x00: case 0x01: case 0x02: case 0x03:
+    case 0x28: case 0x29: case 0x2a: case 0x2b:
+    case 0x38: case 0x39: case 0x3a: case 0x3b: {
+        u8 kind = opcode >> 3;
+        struct ref_operand rm = ref_fetch_modrm(r, segment, &reg);
+        u16 a = (opcode & 2) ? ref_get_reg(r, reg, w) : ref_get(r, rm, w);
+        u16 b = (opcode & 2) ? ref_get(r, rm, w) : ref_get_reg(r, reg, w);
+        u16 result = ref_arith(r, kind, a, b, w);
+        if (kind != 7) {
+            if (opcode & 2) {
+                ref_set_reg(r, reg, w, result);
+            } else {
+                ref_set(r, rm, w, result);
+            }
+        }
+    } break;
+
+    case 0x04: case 0x05: case 0x2c: case 0x2d: case 0x3c: case 0x3d: {
+        u8 kind = opcode >> 3;
+        u16 value = (w) ? ref_fetch_word(r) : ref_fetch(r);
+        u16 result = ref_arith(r, kind, ref_get_reg(r, reg_AX, w), value, w);
+        if (kind != 7) {
+            ref_set_reg(r, reg_AX, w, result);
+        }
+    } break;
+
+    case 0x80: case 0x81: case 0x83: {
+        struct ref_operand rm = ref_fetch_modrm(r, segment, &reg);
+        u16 value = (opcode == 0x81) ? ref_fetch_word(r) : (opcode == 0x83) ? (u16)(i8)ref_fetch(r) : ref_fetch(r);
+        assert(reg == 0 || reg == 5 || reg == 7);
+        u16 result = ref_arith(r, reg, ref_get(r, rm, w), value, w);
+        if (reg != 7) {
+            ref_set(r, rm, w, result);
+        }
+    } break;
+
+    case 0x75: {
+        i8 disp = ref_fetch(r);
+        if (!(r->flags & flags_ZERO)) {
+            r->ip += disp;
+        }
+    } break;
+
+    default: assert(!"op the generator does not emit");
+    }
+}
+
+static void
+ref_reset(struct ref *r, const u8 *code, u32 ncode) {
+    for (u32 i = 0; i < r->nwritten; i++) {
+        r->memory[r->written[i]] = 0;
+    }
+    r->nwritten = 0;
+    // NOTE: patches read past the end of shorter code
+    memset(r->memory + (CODE_SEGMENT << 4), 0, r->nbytes);
+    memset(r->regs, 0, sizeof(r->regs));
+    memset(r->sregs, 0, sizeof(r->sregs));
+    r->sregs[sreg_CS] = CODE_SEGMENT;
+    r->ip = 0;
+    r->flags = 0;
+    r->nbytes = ncode;
+    memcpy(r->memory + (CODE_SEGMENT << 4), code, ncode);
+}
+
+// NOTE: one thread's cpu, reference and counters
+
+// NOTE: -engine, the block engines run a case to its end in one go
+enum engines {
+    engines_STEP = 0x1, // NOTE: c8086_step, compared after every op
+    engines_FAST = 0x2,
+    engines_JIT = 0x4,
+};
+
+struct worker {
+    pthread_t thread;
+    u64 seed;
+    u64 ncases_max;
+    f64 deadline; // NOTE: 0 - none
+    const char *failure_path;
+    enum engines engines;
+
+    struct c8086 *cpu;
+    struct ref ref;
+    u8 code[MAX_ITEMS * ITEM_MAX_SIZE];
+    u64 ncases;
+    u64 nops;
+    bool failed;
+};
+
+struct mismatch {
+    const char *engine; // NOTE: NULL - c8086_step, otherwise only the final state is known
+    u32 step;
+    u16 ip; // NOTE: of the op that went wrong
+    char what[128];
+};
+
+static bool
+compare_state(struct worker *w, struct mismatch *mismatch) {
+    struct c8086 *cpu = w->cpu;
+    struct ref *r = &w->ref;
+    for (int i = 0; i < reg_num; i++) {
+        if (c8086_reg(cpu, i) != r->regs[i]) {
+            snprintf(mismatch->what, sizeof(mismatch->what), "%s: c8086 0x%04x, reference 0x%04x",
+                     reg_name(i, 1), c8086_reg(cpu, i), r->regs[i]);
+            return false;
+        }
+    }
+    for (int i = 0; i < sreg_num; i++) {
+        if (c8086_sreg(cpu, i) != r->sregs[i]) {
+            snprintf(mismatch->what, sizeof(mismatch->what), "%s: c8086 0x%04x, reference 0x%04x",
+                     sreg_name(i), c8086_sreg(cpu, i), r->sregs[i]);
+            return false;
+        }
+    }
+    if (c8086_ip(cpu) != r->ip) {
+        snprintf(mismatch->what, sizeof(mismatch->what), "ip: c8086 0x%04x, reference 0x%04x", c8086_ip(cpu), r->ip);
+        return false;
+    }
+    if (c8086_flags(cpu) != r->flags) {
+        snprintf(mismatch->what, sizeof(mismatch->what), "flags: c8086 0x%02x, reference 0x%02x", c8086_flags(cpu), r->flags);
+        return false;
+    }
+    return true;
+}
+
+static bool
+compare_memory(struct worker *w, struct mismatch *mismatch) {
+    struct ref *r = &w->ref;
+    for (u32 i = 0; i < r->nwritten; i++) {
+        u8 value;
+        c8086_read_memory(w->cpu, r->written[i], &value, 1);
+        if (value != r->memory[r->written[i]]) {
+            snprintf(mismatch->what, sizeof(mismatch->what), "memory 0x%05x: c8086 0x%02x, reference 0x%02x",
+                     r->written[i], value, r->memory[r->written[i]]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// NOTE: false with mismatch set when c8086 and the reference disagree
+static bool
+run_case(struct worker *w, const struct program *program, struct mismatch *mismatch) {
+    struct ref *r = &w->ref;
+    u32 ncode = program_assemble(program, w->code);
+    bool step_engine = w->engines & engines_STEP;
+    c8086_reset(w->cpu);
+    c8086_load(w->cpu, w->code, ncode, CODE_SEGMENT);
+    ref_reset(r, w->code, ncode);
+
+    mismatch->engine = NULL;
+    u32 nsteps = 0;
+    for (; r->ip < r->nbytes && nsteps < MAX_STEPS; nsteps++) {
+        mismatch->step = nsteps;
+        mismatch->ip = r->ip;
+        ref_step(r);
+        if (step_engine) {
+            c8086_step(w->cpu, 1);
+            w->nops++;
+            if (!compare_state(w, mismatch)) {
+                return false;
+            }
+        }
+    }
+    if (step_engine && !compare_memory(w, mismatch)) {
+        return false;
+    }
+
+    static const struct {
+        enum engines engine;
+        enum c8086_engine c8086_engine;
+        const char *name;
+    } block_engines[] = {
+        {engines_FAST, c8086_FAST, "fast"},
+        {engines_JIT, c8086_JIT, "jit"},
+    };
+    for (u32 i = 0; i < len(block_engines); i++) {
+        if (!(w->engines & block_engines[i].engine)) {
+            continue;
+        }
+        c8086_reset(w->cpu);
+        c8086_load(w->cpu, w->code, ncode, CODE_SEGMENT);
+        c8086_run(w->cpu, block_engines[i].c8086_engine);
+        w->nops += nsteps;
+        mismatch->engine = block_engines[i].name;
+        mismatch->step = nsteps;
+        mismatch->ip = r->ip;
+        if (!compare_state(w, mismatch) || !compare_memory(w, mismatch)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// NOTE: drop items while the program still fails; a loop goes as a whole,
+// its begin and end are never split
+static void
+shrink(struct worker *w, struct program *program, struct mismatch *mismatch) {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (u32 i = 0; i < program->nitems; i++) {
+            u32 first = i;
+            u32 end = i + 1;
+            if (program->items[i].kind == item_LOOP_BEGIN) {
+                while (program->items[end - 1].kind != item_LOOP_END) {
+                    end++;
+                }
+            } else if (program->items[i].kind == item_LOOP_END) {
+                continue;
+            }
+
+            struct program smaller = *program;
+            memmove(smaller.items + first, smaller.items + end, (smaller.nitems - end) * sizeof(*smaller.items));
+            smaller.nitems -= end - first;
+            struct mismatch smaller_mismatch;
+            if (smaller.nitems && !run_case(w, &smaller, &smaller_mismatch)) {
+                *program = smaller;
+                *mismatch = smaller_mismatch;
+                progress = true;
+                i--;
+            }
+        }
+    }
+}
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+report_failure(struct worker *w, u64 seed, struct program *program, struct mismatch *mismatch) {
+    shrink(w, program, mismatch);
+    u32 ncode = program_assemble(program, w->code);
+
+    pthread_mutex_lock(&report_lock);
+    fprintf(stderr, "case seed 0x%lx fails after shrinking to %u items, %u bytes:\n", seed, program->nitems, ncode);
+    if (mismatch->engine) {
+        fprintf(stderr, "  -exec-%s, final state after %u ops: %s\n", mismatch->engine, mismatch->step, mismatch->what);
+    } else {
+        fprintf(stderr, "  op %u at ip 0x%04x: %s\n", mismatch->step, mismatch->ip, mismatch->what);
+    }
+    fprintf(stderr, "  bytes:");
+    for (u32 i = 0; i < ncode; i++) {
+        fprintf(stderr, " %02x", w->code[i]);
+    }
+    fprintf(stderr, "\n");
+    FILE *file = fopen(w->failure_path, "wb");
+    if (file) {
+        fwrite(w->code, 1, ncode, file);
+        fclose(file);
+        fprintf(stderr, "  written to %s, run it with: c8086 %s -exec%s%s -load-segment 0x%x\n",
+                w->failure_path, w->failure_path, (mismatch->engine) ? "-" : "",
+                (mismatch->engine) ? mismatch->engine : "", CODE_SEGMENT);
+    }
+    pthread_mutex_unlock(&report_lock);
+}
+
+static void *
+worker_main(void *arg) {
+    struct worker *w = arg;
+    w->cpu = c8086_create();
+    w->ref.memory = calloc(MEMORY_MASK + 1, 1);
+    assert(w->ref.memory);
+
+    struct program *p = malloc(sizeof(*p));
+    assert(p);
+    while (w->ncases < w->ncases_max && (!w->deadline || seconds_now() < w->deadline)) {
+        // NOTE: every case has its own seed, a failure is reproduced from it alone
+        u64 seed = w->seed + w->ncases;
+        struct gen g = {.state = seed * 0x9e3779b97f4a7c15ull | 1};
+        gen_program(&g, p);
+        struct mismatch mismatch;
+        w->ncases++;
+        if (!run_case(w, p, &mismatch)) {
+            report_failure(w, seed, p, &mismatch);
+            w->failed = true;
+            break;
+        }
+    }
+
+    free(p);
+    free(w->ref.written);
+    free(w->ref.memory);
+    c8086_destroy(w->cpu);
+    return NULL;
+}
+
+int
+main(int argc, char *argv[]) {
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    u64 ncases = 0;
+    f64 seconds = 0;
+    u64 seed = 1;
+    const char *failure_path = "diff8086_failure";
+    enum engines engines = engines_STEP;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            nthreads = strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-cases") == 0 && i + 1 < argc) {
+            ncases = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-seconds") == 0 && i + 1 < argc) {
+            seconds = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-failure") == 0 && i + 1 < argc) {
+            failure_path = argv[++i];
+        } else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc) {
+            i++;
+            engines = (strcmp(argv[i], "step") == 0) ? engines_STEP :
+                      (strcmp(argv[i], "fast") == 0) ? engines_FAST :
+                      (strcmp(argv[i], "jit") == 0) ? engines_JIT :
+                      (strcmp(argv[i], "all") == 0) ? engines_STEP | engines_FAST | engines_JIT : 0;
+        } else {
+            nthreads = 0;
+            break;
+        }
+    }
+    if (nthreads < 1 || nthreads > 1024 || (!ncases && seconds <= 0) || !engines) {
+        fprintf(stderr, "Usage: %s -cases N | -seconds S [-threads N] [-seed S] [-failure FILE] [-engine step|fast|jit|all]\n", argv[0]);
+        return 1;
+    }
+
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    assert(workers);
+    f64 started = seconds_now();
+    f64 deadline = (seconds > 0) ? started + seconds : 0;
+    for (long i = 0; i < nthreads; i++) {
+        // NOTE: with -cases the split is fixed, so the cases run do not depend on timing
+        u64 share = (ncases) ? ncases / nthreads + ((u64)i < ncases % nthreads) : UINT64_MAX;
+        workers[i].seed = seed + (u64)i * (1ull << 40);
+        workers[i].ncases_max = share;
+        workers[i].deadline = deadline;
+        workers[i].failure_path = failure_path;
+        workers[i].engines = engines;
+        int error = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        assert(!error);
+    }
+
+    u64 total_cases = 0;
+    u64 total_ops = 0;
+    bool failed = false;
+    for (long i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total_cases += workers[i].ncases;
+        total_ops += workers[i].nops;
+        failed |= workers[i].failed;
+    }
+    f64 elapsed = seconds_now() - started;
+    printf("diff8086: %lu cases, %lu ops on %ld threads in %.2fs: %.2f M cases/min%s\n", total_cases, total_ops,
+           nthreads, elapsed, total_cases / elapsed * 60 / 1e6, (failed) ? ", FAILED" : "");
+    free(workers);
+    return (failed) ? 1 : 0;
+}
@@ -0,0 +1,92 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../basic.h"
+#include "libc8086.h"
+
+// NOTE: drives the core through the library API, many images in one process.
+// Every image runs REPEAT times on one cpu with reset in between, the last
+// run single-steps with tracing on and prints what `c8086 PATH -exec` prints
+
+static void
+write_stdout(void *user, const u8 *data, u32 n) {
+    fwrite(data, 1, n, stdout);
+}
+
+static u8 *
+read_image(const char *path, u32 *ndata) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    u8 *data = malloc((size > 0) ? size : 1);
+    assert(data);
+    *ndata = fread(data, 1, size, file);
+    fclose(file);
+    return data;
+}
+
+int
+main(int argc, char *argv[]) {
+    int first_path = 1;
+    u32 repeat = 1;
+    if (argc > 2 && strcmp(argv[1], "-repeat") == 0) {
+        repeat = strtoul(argv[2], NULL, 0);
+        first_path = 3;
+    }
+    if (first_path >= argc || repeat == 0) {
+        fprintf(stderr, "Usage: %s [-repeat N] PATH...\n", argv[0]);
+        return 1;
+    }
+
+    struct c8086 *cpu = c8086_create();
+    for (int i = first_path; i < argc; i++) {
+        u32 ndata;
+        u8 *data = read_image(argv[i], &ndata);
+        if (!data) {
+            fprintf(stderr, "Cannot open '%s'\n", argv[i]);
+            return 1;
+        }
+        if (!c8086_load(cpu, data, ndata, 0)) {
+            fprintf(stderr, "'%s' does not fit in a code segment\n", argv[i]);
+            return 1;
+        }
+
+        u16 ip = 0;
+        for (u32 run = 0; run + 1 < repeat; run++) {
+            c8086_reset(cpu);
+            c8086_load(cpu, data, ndata, 0);
+            enum c8086_status status = c8086_step(cpu, 0);
+            assert(status == c8086_HALTED);
+            assert(run == 0 || c8086_ip(cpu) == ip);
+            ip = c8086_ip(cpu);
+        }
+
+        printf("--- %s execution ---\n", argv[i]);
+        fflush(stdout);
+        c8086_reset(cpu);
+        c8086_load(cpu, data, ndata, 0);
+        c8086_set_trace(cpu, write_stdout, NULL, false);
+        enum c8086_status status;
+        while ((status = c8086_step(cpu, 1)) == c8086_STEPPED) {
+        }
+        if (status == c8086_UNSUPPORTED) {
+            fflush(stdout);
+            fprintf(stderr, "Unsupported op at 0x%x in '%s'\n", c8086_ip(cpu), argv[i]);
+            return 1;
+        }
+        assert(repeat == 1 || c8086_ip(cpu) == ip);
+        printf("\n");
+        c8086_trace_regs(cpu);
+        c8086_set_trace(cpu, NULL, NULL, false);
+
+        free(data);
+    }
+    c8086_destroy(cpu);
+    return 0;
+}
@@ -0,0 +1,256 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../basic.h"
+#include "c8086.h"
+
+// NOTE: random but valid 8086 encodings of every form c8086 decodes, written
+// as a flat binary. Apart from reg, reg ops with d = 1, which yasm always
+// assembles with d = 0, encodings are the ones yasm picks for the text c8086
+// prints, so `c8086 | yasm` gives the same ops back:
+//   - displacements are as short as possible, [bp] is the only disp8 of 0
+//   - word immediates that fit in a signed byte use the 0x83 form
+//   - al/ax with an immediate or a direct address use the short forms
+//   - segment overrides are never the default segment
+//   - jumps stay within what "$+n" can express after the +2 of the op size
+
+struct gen {
+    u64 state;
+    u8 *data;
+    u32 ndata;
+    u32 capacity;
+};
+
+static u32
+gen_random(struct gen *g, u32 n) {
+    u64 x = g->state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    g->state = x;
+    return (x >> 16) % n;
+}
+
+static void
+emit(struct gen *g, u8 byte) {
+    assert(g->ndata < g->capacity);
+    g->data[g->ndata++] = byte;
+}
+
+static void
+emit_word(struct gen *g, u16 word) {
+    emit(g, word);
+    emit(g, word >> 8);
+}
+
+// NOTE: a word immediate for the 0x81 and accumulator forms, never one that
+// yasm would shorten to a sign-extended byte
+static u16
+gen_wide_immediate(struct gen *g) {
+    return 128 + gen_random(g, 0xff80 - 128);
+}
+
+struct operand {
+    u8 mod;
+    u8 rm;
+    u8 ndisp;
+    u16 disp;
+    u8 prefix; // NOTE: segment override byte, 0 - none
+};
+
+static u8
+gen_segment_prefix(struct gen *g, enum sreg default_segment) {
+    if (gen_random(g, 4)) {
+        return 0;
+    }
+    enum sreg segment;
+    do {
+        segment = gen_random(g, sreg_num);
+    } while (segment == default_segment);
+    return 0x26 | (segment << 3);
+}
+
+static struct operand
+gen_register(struct gen *g) {
+    return (struct operand){.mod = 0b11, .rm = gen_random(g, 8)};
+}
+
+static struct operand
+gen_memory(struct gen *g) {
+    struct operand result = {.mod = gen_random(g, 3), .rm = gen_random(g, 8)};
+    bool direct = result.mod == 0b00 && result.rm == 0b110;
+    bool bp_based = result.rm == 0b010 || result.rm == 0b011 || (result.rm == 0b110 && !direct);
+    if (direct) {
+        result.ndisp = 2;
+        result.disp = gen_random(g, 0x10000);
+    } else if (result.mod == 0b01) {
+        result.ndisp = 1;
+        do {
+            result.disp = gen_random(g, 256);
+        } while (result.disp == 0 && result.rm != 0b110);
+    } else if (result.mod == 0b10) {
+        result.ndisp = 2;
+        result.disp = gen_wide_immediate(g);
+    }
+    result.prefix = gen_segment_prefix(g, (bp_based) ? sreg_SS : sreg_DS);
+    return result;
+}
+
+static bool
+operand_is_direct(struct operand operand) {
+    return operand.mod == 0b00 && operand.rm == 0b110;
+}
+
+static void
+emit_modrm(struct gen *g, u8 opcode, u8 reg, struct operand operand) {
+    if (operand.prefix) {
+        emit(g, operand.prefix);
+    }
+    emit(g, opcode);
+    emit(g, (operand.mod << 6) | (reg << 3) | operand.rm);
+    if (operand.ndisp == 1) {
+        emit(g, operand.disp);
+    } else if (operand.ndisp == 2) {
+        emit_word(g, operand.disp);
+    }
+}
+
+enum form {
+    form_RM_REG,
+    form_IMM_TO_RM,
+    form_IMM_TO_ACC,
+    form_MOV_IMM_TO_MEM,
+    form_MOV_IMM_TO_REG,
+    form_MOV_ACC,
+    form_MOV_SREG,
+    form_JUMP,
+
+    form_num,
+};
+
+static void
+gen_op(struct gen *g) {
+    u8 w = gen_random(g, 2);
+    switch ((enum form)gen_random(g, form_num)) {
+    case form_RM_REG: {
+        static const u8 opcodes[] = {0x88, 0x00, 0x28, 0x38}; // NOTE: mov, add, sub, cmp
+        u8 opcode = opcodes[gen_random(g, len(opcodes))];
+        u8 reg = gen_random(g, 8);
+        u8 d = gen_random(g, 2) << 1;
+        if (gen_random(g, 2)) {
+            emit_modrm(g, opcode | d | w, reg, gen_register(g));
+        } else {
+            struct operand operand = gen_memory(g);
+            if (opcode == 0x88 && operand_is_direct(operand) && reg == reg_AX) {
+                reg = 1 + gen_random(g, 7);
+            }
+            emit_modrm(g, opcode | d | w, reg, operand);
+        }
+    } break;
+
+    case form_IMM_TO_RM: {
+        static const u8 kinds[] = {0b000, 0b101, 0b111}; // NOTE: add, sub, cmp
+        u8 kind = kinds[gen_random(g, len(kinds))];
+        struct operand operand = (gen_random(g, 2)) ? gen_register(g) : gen_memory(g);
+        if (operand.mod == 0b11 && operand.rm == reg_AX) {
+            operand.rm = 1 + gen_random(g, 7);
+        }
+        if (!w) {
+            emit_modrm(g, 0x80, kind, operand);
+            emit(g, gen_random(g, 256));
+        } else if (gen_random(g, 2)) {
+            emit_modrm(g, 0x83, kind, operand);
+            emit(g, gen_random(g, 256));
+        } else {
+            emit_modrm(g, 0x81, kind, operand);
+            emit_word(g, gen_wide_immediate(g));
+        }
+    } break;
+
+    case form_IMM_TO_ACC: {
+        static const u8 opcodes[] = {0x04, 0x2c, 0x3c}; // NOTE: add, sub, cmp
+        emit(g, opcodes[gen_random(g, len(opcodes))] | w);
+        if (w) {
+            emit_word(g, gen_wide_immediate(g));
+        } else {
+            emit(g, gen_random(g, 256));
+        }
+    } break;
+
+    case form_MOV_IMM_TO_MEM: {
+        emit_modrm(g, 0xc6 | w, 0, gen_memory(g));
+        if (w) {
+            emit_word(g, gen_random(g, 0x10000));
+        } else {
+            emit(g, gen_random(g, 256));
+        }
+    } break;
+
+    case form_MOV_IMM_TO_REG: {
+        emit(g, 0xb0 | (w << 3) | gen_random(g, 8));
+        if (w) {
+            emit_word(g, gen_random(g, 0x10000));
+        } else {
+            emit(g, gen_random(g, 256));
+        }
+    } break;
+
+    case form_MOV_ACC: {
+        u8 prefix = gen_segment_prefix(g, sreg_DS);
+        if (prefix) {
+            emit(g, prefix);
+        }
+        emit(g, 0xa0 | (gen_random(g, 2) << 1) | w);
+        emit_word(g, gen_random(g, 0x10000));
+    } break;
+
+    case form_MOV_SREG: {
+        struct operand operand = (gen_random(g, 2)) ? gen_register(g) : gen_memory(g);
+        if (gen_random(g, 2)) {
+            emit_modrm(g, 0x8c, gen_random(g, sreg_num), operand);
+        } else {
+            // NOTE: no mov cs
+            static const enum sreg writable[] = {sreg_ES, sreg_SS, sreg_DS};
+            emit_modrm(g, 0x8e, writable[gen_random(g, len(writable))], operand);
+        }
+    } break;
+
+    case form_JUMP: {
+        u8 opcode = (gen_random(g, 5)) ? 0x70 + gen_random(g, 16) : 0xe0 + gen_random(g, 4);
+        emit(g, opcode);
+        emit(g, (u8)(-128 + (int)gen_random(g, 254)));
+    } break;
+
+    case form_num: unreachable();
+    }
+}
+
+// NOTE: the longest op the generator writes, prefix + opcode + modrm + disp16 + data16
+#define GEN_OP_MAX_SIZE 7
+
+int
+main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s SEED NBYTES > FILE\n", argv[0]);
+        return 1;
+    }
+    u64 seed = strtoull(argv[1], NULL, 0);
+    u32 nbytes = strtoul(argv[2], NULL, 0);
+
+    struct gen g = {
+        .state = (seed) ? seed : 1,
+        .capacity = nbytes + GEN_OP_MAX_SIZE,
+    };
+    g.data = malloc(g.capacity);
+    assert(g.data);
+
+    // NOTE: stops at the first op that reaches nbytes, so a few bytes more
+    while (g.ndata < nbytes) {
+        gen_op(&g);
+    }
+
+    fwrite(g.data, 1, g.ndata, stdout);
+    free(g.data);
+    return 0;
+}
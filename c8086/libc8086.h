@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// NOTE: library API, `make lib` builds it without main. The core never
+// prints, trace text goes to the callback of c8086_set_trace or nowhere.
+// The cpu is opaque, it is only ever handled through a pointer
+
+enum reg {
+    reg_AX,
+    reg_CX,
+    reg_DX,
+    reg_BX,
+    reg_SP,
+    reg_BP,
+    reg_SI,
+    reg_DI,
+
+    reg_num,
+};
+
+// NOTE: in the order of the sr field of mov sreg and the override prefixes
+enum sreg {
+    sreg_ES,
+    sreg_CS,
+    sreg_SS,
+    sreg_DS,
+
+    sreg_num,
+};
+
+enum flags {
+    flags_CARRY = 0x1,
+    flags_PARITY = 0x2,
+    flags_AUX_CARRY = 0x4,
+    flags_ZERO = 0x8,
+    flags_SIGN = 0x10,
+    flags_OVERFLOW = 0x20,
+};
+
+// NOTE: receives trace text in chunks, for embedding the core
+typedef void (*trace_write_proc)(void *user, const uint8_t *data, uint32_t n);
+
+enum c8086_status {
+    c8086_STEPPED, // NOTE: ran the requested number of ops
+    c8086_HALTED, // NOTE: ip left the image
+    c8086_BREAKPOINT, // NOTE: ip is at a breakpoint, the op there has not run
+    c8086_UNSUPPORTED, // NOTE: ip is at an op c8086 cannot simulate, like mov cs, until c8086_reset
+};
+
+enum c8086_engine {
+    c8086_INTERPRETER, // NOTE: -exec, what c8086_step runs
+    c8086_FAST, // NOTE: -exec-fast, threaded code
+    c8086_JIT, // NOTE: -exec-jit, threaded code with the hot blocks compiled
+};
+
+struct c8086;
+
+struct c8086 *c8086_create(void);
+void c8086_destroy(struct c8086 *c);
+void c8086_reset(struct c8086 *c);
+// NOTE: false when the image does not fit below 1 MiB or fills the whole
+// 64 KiB code segment, which ip could never leave
+bool c8086_load(struct c8086 *c, const void *data, uint32_t ndata, uint16_t segment);
+void c8086_set_trace(struct c8086 *c, trace_write_proc write, void *user, bool print_ip);
+void c8086_set_breakpoint(struct c8086 *c, uint16_t ip);
+void c8086_clear_breakpoint(struct c8086 *c, uint16_t ip);
+enum c8086_status c8086_step(struct c8086 *c, uint64_t count);
+enum c8086_status c8086_run(struct c8086 *c, enum c8086_engine engine);
+uint16_t c8086_reg(struct c8086 *c, enum reg reg);
+uint16_t c8086_sreg(struct c8086 *c, enum sreg sreg);
+uint16_t c8086_ip(struct c8086 *c);
+enum flags c8086_flags(struct c8086 *c);
+void c8086_read_memory(struct c8086 *c, uint32_t address, void *out, uint32_t n);
+void c8086_trace_regs(struct c8086 *c);
@@ -0,0 +1,14 @@
+; ========================================================================
+; Long register-only loop for -bench-exec, hot enough for -exec-jit
+; ========================================================================
+
+bits 16
+
+mov bx, 0
+mov cx, 60000
+
+loop_start:
+add bx, 3
+mov si, bx
+sub cx, 1
+jnz loop_start
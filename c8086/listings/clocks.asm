@@ -0,0 +1,39 @@
+; ========================================================================
+; Clock estimates for every ea form, odd word transfers and a short loop
+; ========================================================================
+
+bits 16
+
+mov bx, 1000
+mov bp, 2000
+mov si, 3000
+mov di, 4000
+
+mov cx, bx
+mov dx, 12
+
+mov dx, [1000]
+
+mov cx, [bx]
+mov cx, [bp]
+mov [si], cx
+mov [di], cx
+
+mov cx, [bx + 1000]
+mov cx, [bp + 1000]
+mov [si + 1000], cx
+mov [di + 1000], cx
+
+add cx, dx
+add [di + 1000], cx
+add dx, 50
+
+mov ax, [bx + si + 1]
+mov al, [bx + si + 1]
+add word [es:bp + di + 3], 7
+cmp ax, [bx]
+
+mov cx, 3
+loop_start:
+sub cx, 1
+jnz loop_start
@@ -0,0 +1,17 @@
+; ========================================================================
+; cmp reg, imm as the only flag setter before jnz, -exec-jit has to compile
+; the loop from the cmp alone
+; ========================================================================
+
+bits 16
+
+mov word [1000], 1002
+mov word [1002], 1004
+mov word [1004], 1006
+mov word [1006], 0
+mov bx, 1000
+
+loop_start:
+mov bx, [bx]
+cmp bx, 0
+jnz loop_start
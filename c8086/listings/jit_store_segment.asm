@@ -0,0 +1,17 @@
+; ========================================================================
+; Word stores through a data segment away from the code, -exec-jit runs the
+; loop natively and has to mark the same pages dirty as -exec
+; ========================================================================
+
+bits 16
+
+mov ax, 0x1000
+mov ds, ax
+mov bx, 0
+mov cx, 200
+
+loop_start:
+mov [bx], cx
+add bx, 2
+sub cx, 1
+jnz loop_start
@@ -0,0 +1,9 @@
+; ========================================================================
+; More distinct instructions than the old fixed 128-op program buffer held
+; ========================================================================
+
+bits 16
+
+%rep 300
+add cx, 1
+%endrep
@@ -0,0 +1,10 @@
+; ========================================================================
+; mov cs, r/m is not simulated, every engine stops at it with ip there
+; ========================================================================
+
+bits 16
+
+mov ax, 0x1234
+mov bx, ax
+mov cs, bx
+mov cx, 1
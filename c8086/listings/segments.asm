@@ -0,0 +1,29 @@
+; ========================================================================
+; Segment registers, default segments, overrides and word memory access
+; ========================================================================
+
+bits 16
+
+mov ax, 0x2000
+mov ds, ax
+mov ax, 0x3000
+mov es, ax
+mov ax, 0x4000
+mov ss, ax
+
+mov bx, 0xfffe
+mov word [bx], 0x1234
+mov word [es:bx], 0x5678
+mov cx, [bx]
+mov dx, [es:bx]
+mov al, [bx]
+mov ah, [es:bx + 1]
+
+mov bp, 0x10
+mov word [bp], 7
+mov word [ds:bp], 9
+mov si, [bp]
+mov di, [ds:bp]
+
+mov sp, es
+add sp, [es:bx]
@@ -0,0 +1,9 @@
+; ========================================================================
+; Patches the immediate of the following mov before it executes
+; ========================================================================
+
+bits 16
+
+mov cx, 3
+mov byte [9], 7
+mov dx, 1
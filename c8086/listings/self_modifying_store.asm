@@ -0,0 +1,15 @@
+; ========================================================================
+; Patches the code ahead through stores other than mov r/m, imm
+; ========================================================================
+
+bits 16
+
+mov ax, 0x1234
+mov [10], ax ; the immediate of mov bx
+mov cx, 2
+mov bx, 0
+add [17], cx ; the immediate of mov dx
+mov dx, 1
+mov es, ax
+mov [26], es ; the immediate of mov si
+mov si, 5
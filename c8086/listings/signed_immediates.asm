@@ -0,0 +1,13 @@
+; ========================================================================
+; Negative sign-extended imm8 of the 0x80 group, c8086 has to print them
+; negative for yasm to pick 0x83 again
+; ========================================================================
+
+bits 16
+
+add bx, -5
+sub cx, -128
+cmp dx, -1
+add word [bp + si + 1000], -3
+sub word [bx], -100
+cmp word [di - 8], -2
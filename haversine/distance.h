@@ -0,0 +1,157 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#include "../basic.h"
+
+#define sqr(a) ((a) * (a))
+#define pi 3.14159265358979323846f
+
+static inline f32
+radians(f32 degrees) {
+    f32 result = degrees * pi / 180.0f;
+    return result;
+}
+
+static inline f32
+haversine_distance(f32 x0, f32 y0, f32 x1, f32 y1, f32 radius) {
+    f32 dY = radians(y1 - y0);
+    f32 dX = radians(x1 - x0);
+    y0 = radians(y0);
+    y1 = radians(y1);
+
+    f32 root = (sqr(sinf(dY/2.0f))) + cosf(y0) * cosf(y1) * sqr(sin(dX/2));
+    f32 result = 2.0f * radius * asin(sqrt(root));
+    return result;
+}
+
+// NOTE: haversine_distance 8 pairs at a time from separate x0/y0/x1/y1
+// arrays, all in f32 with the Cephes sinf/cosf/asinf polynomials instead of
+// libm. With the earth radius it stays within HAVERSINE_MAX_ERROR_KM of
+// haversine_distance, over data.json and 100M uniform pairs the largest
+// difference was 1.29km. That is at nearly antipodal pairs, where the root
+// is close to 1 and one f32 ulp of it moves asin(sqrt(root)) that far;
+// haversine_distance itself is up to 2.8km off an f64 evaluation there and
+// the batch is no further off. Most distances agree to within an ulp
+#define HAVERSINE_BATCH 8
+#define HAVERSINE_MAX_ERROR_KM 1.5
+
+// NOTE: |x| < 8192, reduced to [-pi/4, pi/4] with the octant picking the sin
+// or cos polynomial and the sign, pi/4 is split in three to keep it exact
+__attribute__((target("avx2,fma")))
+static inline __m256
+haversine_sin_cos8(__m256 x, bool cosine) {
+    __m256 sign_bit = _mm256_set1_ps(-0.0f);
+    __m256 sign = (cosine) ? _mm256_setzero_ps() : _mm256_and_ps(x, sign_bit);
+    x = _mm256_andnot_ps(sign_bit, x);
+
+    __m256i octant = _mm256_cvttps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(1.27323954473516f)));
+    octant = _mm256_and_si256(_mm256_add_epi32(octant, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+    __m256 y = _mm256_cvtepi32_ps(octant);
+    if (cosine) {
+        octant = _mm256_sub_epi32(octant, _mm256_set1_epi32(2));
+        sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_andnot_si256(octant, _mm256_set1_epi32(4)), 29));
+    } else {
+        sign = _mm256_xor_ps(sign, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(octant, _mm256_set1_epi32(4)), 29)));
+    }
+    __m256i cos_octant = _mm256_and_si256(octant, _mm256_set1_epi32(2));
+    __m256 use_cos = _mm256_castsi256_ps(_mm256_cmpeq_epi32(cos_octant, _mm256_set1_epi32(2)));
+
+    x = _mm256_fmadd_ps(y, _mm256_set1_ps(-0.78515625f), x);
+    x = _mm256_fmadd_ps(y, _mm256_set1_ps(-2.4187564849853515625e-4f), x);
+    x = _mm256_fmadd_ps(y, _mm256_set1_ps(-3.77489497744594108e-8f), x);
+    __m256 z = _mm256_mul_ps(x, x);
+
+    __m256 c = _mm256_fmadd_ps(_mm256_set1_ps(2.443315711809948e-5f), z, _mm256_set1_ps(-1.388731625493765e-3f));
+    c = _mm256_fmadd_ps(c, z, _mm256_set1_ps(4.166664568298827e-2f));
+    c = _mm256_mul_ps(_mm256_mul_ps(c, z), z);
+    c = _mm256_add_ps(_mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, c), _mm256_set1_ps(1.0f));
+
+    __m256 s = _mm256_fmadd_ps(_mm256_set1_ps(-1.9515295891e-4f), z, _mm256_set1_ps(8.3321608736e-3f));
+    s = _mm256_fmadd_ps(s, z, _mm256_set1_ps(-1.6666654611e-1f));
+    s = _mm256_fmadd_ps(_mm256_mul_ps(s, z), x, x);
+
+    return _mm256_xor_ps(_mm256_blendv_ps(s, c, use_cos), sign);
+}
+
+// NOTE: asin(sqrt(r)) for r in [0, 1], past 0.5 through
+// asin(x) = pi/2 - 2 asin(sqrt((1 - x) / 2)) so the polynomial stays small
+__attribute__((target("avx2,fma")))
+static inline __m256
+haversine_asin_sqrt8(__m256 r) {
+    r = _mm256_min_ps(_mm256_max_ps(r, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+    __m256 x = _mm256_sqrt_ps(r);
+    __m256 big = _mm256_cmp_ps(x, _mm256_set1_ps(0.5f), _CMP_GT_OQ);
+    __m256 z_big = _mm256_mul_ps(_mm256_set1_ps(0.5f), _mm256_sub_ps(_mm256_set1_ps(1.0f), x));
+    __m256 z = _mm256_blendv_ps(r, z_big, big);
+    x = _mm256_blendv_ps(x, _mm256_sqrt_ps(z_big), big);
+
+    __m256 p = _mm256_fmadd_ps(_mm256_set1_ps(4.2163199048e-2f), z, _mm256_set1_ps(2.4181311049e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(4.5470025998e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(7.4953002686e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(1.6666752422e-1f));
+    p = _mm256_fmadd_ps(_mm256_mul_ps(p, z), x, x);
+
+    __m256 folded = _mm256_fnmadd_ps(_mm256_set1_ps(2.0f), p, _mm256_set1_ps(pi / 2));
+    return _mm256_blendv_ps(p, folded, big);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256
+haversine_distance8(__m256 x0, __m256 y0, __m256 x1, __m256 y1, f32 radius) {
+    __m256 to_radians = _mm256_set1_ps(pi / 180.0f);
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256 dY = _mm256_mul_ps(_mm256_sub_ps(y1, y0), to_radians);
+    __m256 dX = _mm256_mul_ps(_mm256_sub_ps(x1, x0), to_radians);
+    __m256 sin_dY = haversine_sin_cos8(_mm256_mul_ps(dY, half), false);
+    __m256 sin_dX = haversine_sin_cos8(_mm256_mul_ps(dX, half), false);
+    __m256 cos_y0 = haversine_sin_cos8(_mm256_mul_ps(y0, to_radians), true);
+    __m256 cos_y1 = haversine_sin_cos8(_mm256_mul_ps(y1, to_radians), true);
+
+    __m256 root = _mm256_mul_ps(_mm256_mul_ps(cos_y0, cos_y1), _mm256_mul_ps(sin_dX, sin_dX));
+    root = _mm256_fmadd_ps(sin_dY, sin_dY, root);
+    return _mm256_mul_ps(_mm256_set1_ps(2.0f * radius), haversine_asin_sqrt8(root));
+}
+
+__attribute__((target("avx2,fma")))
+static void
+haversine_distances_avx2(const f32 *x0, const f32 *y0, const f32 *x1, const f32 *y1,
+                         f32 *distances, u64 n, f32 radius) {
+    u64 i = 0;
+    for (; i + HAVERSINE_BATCH <= n; i += HAVERSINE_BATCH) {
+        __m256 d = haversine_distance8(_mm256_loadu_ps(x0 + i), _mm256_loadu_ps(y0 + i),
+                                       _mm256_loadu_ps(x1 + i), _mm256_loadu_ps(y1 + i), radius);
+        _mm256_storeu_ps(distances + i, d);
+    }
+    // NOTE: the tail padded to a whole batch, every pair goes through the same math
+    if (i < n) {
+        f32 tail[4][HAVERSINE_BATCH] = {};
+        f32 out[HAVERSINE_BATCH];
+        u64 ntail = n - i;
+        memcpy(tail[0], x0 + i, ntail * sizeof(f32));
+        memcpy(tail[1], y0 + i, ntail * sizeof(f32));
+        memcpy(tail[2], x1 + i, ntail * sizeof(f32));
+        memcpy(tail[3], y1 + i, ntail * sizeof(f32));
+        __m256 d = haversine_distance8(_mm256_loadu_ps(tail[0]), _mm256_loadu_ps(tail[1]),
+                                       _mm256_loadu_ps(tail[2]), _mm256_loadu_ps(tail[3]), radius);
+        _mm256_storeu_ps(out, d);
+        memcpy(distances + i, out, ntail * sizeof(f32));
+    }
+}
+
+// NOTE: distances[i] for every pair, haversine_distance itself without AVX2
+static inline void
+haversine_distances(const f32 *x0, const f32 *y0, const f32 *x1, const f32 *y1,
+                    f32 *distances, u64 n, f32 radius) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        haversine_distances_avx2(x0, y0, x1, y1, distances, n, radius);
+        return;
+    }
+    for (u64 i = 0; i < n; i++) {
+        distances[i] = haversine_distance(x0[i], y0[i], x1[i], y1[i], radius);
+    }
+}
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include "parse.h"
+
 #define len(a) (sizeof(a)/sizeof(0[a]))
 #define sqr(a) ((a) * (a))
 #define pi 3.14159265358979323846f
@@ -39,8 +41,7 @@ int
 main() {
     const char *inpath = "data.json";
     printf("Reading from %s\n", inpath);
-    FILE *infile = fopen(inpath, "r");
-    assert(infile);
+    struct mapped_file infile = map_file(inpath);
 
     int count = 0;
     f32 sum = 0;
@@ -48,39 +49,29 @@ main() {
 
     clock_t start_time = clock();
 
-    // NOTE: skip to the first record
-    {
-        char buf[256];
-        int nread = fread(buf, 1, len(buf), infile);
-        assert(nread > 0);
-
-        for (int i = 1; i < nread; i++) {
-            if (buf[i] == '{') {
-                debugf("Found { at %d: %.*s\n", i, 10, buf + i);
-                fseek(infile, i, SEEK_SET);
-                break;
-            }
-        }
-    }
-
-    f32 x0, y0, x1, y1;
+    // NOTE: parsed a batch at a time, the points stay in cache for the sum
+    const char *at = infile.data;
+    const char *end = infile.data + infile.size;
+    f32 points[4 * 1024];
     while (true) {
-        int nscanned = fscanf(infile, "{\"x0\": %f, \"y0\": %f, \"x1\": %f, \"y1\": %f}", &x0, &y0, &x1, &y1);
-        if (nscanned == 0) {
+        u64 npoints = parse_points(&at, end, points, len(points) / 4);
+        if (npoints == 0) {
             break;
         }
-
-        debugf("Got %f %f, %f %f\n", x0, y0, x1, y1);
-
-        fscanf(infile, ",\n");
-
-        sum += haversine_distance(x0, y0, x1, y1, earth_radius_km);
-        count++;
+        for (u64 i = 0; i < npoints; i++) {
+            f32 x0 = points[4*i + 0];
+            f32 y0 = points[4*i + 1];
+            f32 x1 = points[4*i + 2];
+            f32 y1 = points[4*i + 3];
+            debugf("Got %f %f, %f %f\n", x0, y0, x1, y1);
+            sum += haversine_distance(x0, y0, x1, y1, earth_radius_km);
+        }
+        count += npoints;
     }
 
     clock_t end_time = clock();
 
-    fclose(infile);
+    unmap_file(&infile);
 
     f32 avg = sum / count;
     double time_spent = (double)(end_time - start_time)/CLOCKS_PER_SEC;
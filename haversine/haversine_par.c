@@ -0,0 +1,163 @@
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../basic.h"
+#include "../perf/perf.h"
+#include "distance.h"
+#include "parse.h"
+
+// NOTE: thread counts only regroup the f64 partial sums, n additions of
+// positive terms are off by at most n * 2^-53 relative, ~1.1e-9 for 10M
+// pairs. haversine_seq adds up in f32, once the sum is in the 1e10s most of
+// every addition is rounded away and its average comes out ~1.2e-3 low
+#define AVERAGE_TOLERANCE 1e-9
+
+// NOTE: parses and sums the records whose '{' is in [begin, end)
+struct worker {
+    pthread_t thread;
+    enum parse_kernel kernel;
+    const char *begin;
+    const char *end;
+
+    u64 count;
+    f64 sum;
+};
+
+static void *
+worker_main(void *arg) {
+    struct worker *w = arg;
+    f32 earth_radius_km = 6371.0f;
+
+    // NOTE: a batch at a time, the points stay in cache for the sum
+    const char *at = w->begin;
+    f32 points[4 * 1024];
+    while (true) {
+        u64 npoints = parse_points_with(w->kernel, &at, w->end, points, len(points) / 4);
+        if (npoints == 0) {
+            break;
+        }
+        for (u64 i = 0; i < npoints; i++) {
+            f32 x0 = points[4*i + 0];
+            f32 y0 = points[4*i + 1];
+            f32 x1 = points[4*i + 2];
+            f32 y1 = points[4*i + 3];
+            w->sum += haversine_distance(x0, y0, x1, y1, earth_radius_km);
+        }
+        w->count += npoints;
+    }
+    return NULL;
+}
+
+// NOTE: N byte ranges, each but the first moved up to the next '{', so every
+// record is parsed by exactly one thread. Partial sums are added in range
+// order, the same thread count always gives the same bits
+static f64
+average_parallel(struct mapped_file file, enum parse_kernel kernel, int nthreads, u64 *count) {
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    assert(workers);
+    const char *end = file.data + file.size;
+    for (int i = 0; i < nthreads; i++) {
+        const char *begin = file.data;
+        if (i > 0) {
+            begin = file.data + file.size * i / nthreads;
+            begin = memchr(begin, '{', end - begin);
+            begin = (begin) ? begin : end;
+        }
+        workers[i].kernel = kernel;
+        workers[i].begin = begin;
+        workers[i].end = end;
+        if (i > 0) {
+            workers[i - 1].end = begin;
+        }
+    }
+    for (int i = 0; i < nthreads; i++) {
+        int error = pthread_create(&workers[i].thread, NULL, worker_main, workers + i);
+        assert(!error);
+    }
+
+    f64 sum = 0;
+    *count = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        sum += workers[i].sum;
+        *count += workers[i].count;
+    }
+    free(workers);
+    return (*count) ? sum / *count : 0;
+}
+
+int
+main(int argc, char *argv[]) {
+    long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = (ncores < 1) ? 1 : ncores;
+    bool scale = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-scale") == 0) {
+            scale = true;
+        } else {
+            fprintf(stderr, "Usage: %s [-threads N] [-scale]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Invalid thread count %d\n", nthreads);
+        return 1;
+    }
+
+    begin_profile();
+
+    const char *inpath = "data.json";
+    printf("Reading from %s\n", inpath);
+    struct mapped_file infile = map_file(inpath);
+    enum parse_kernel kernel = parse_best_kernel();
+
+    if (!scale) {
+        begin_profile_block("Parse + Haversines");
+        profile_block_bytes(infile.size);
+        u64 count;
+        f64 avg = average_parallel(infile, kernel, nthreads, &count);
+        end_profile_block();
+        printf("Avg of %lu records: %f (%d threads)\n", count, avg, nthreads);
+    } else {
+        // NOTE: 1 to nthreads, after a run that faults the whole file in
+        static char labels[64][32];
+        int max_threads = (nthreads < (int)len(labels)) ? nthreads : (int)len(labels);
+        u64 count;
+        average_parallel(infile, kernel, max_threads, &count);
+        f64 expected = 0;
+        f64 one_thread_seconds = 0;
+        for (int n = 1; n <= max_threads; n++) {
+            snprintf(labels[n - 1], sizeof(labels[n - 1]), "%d threads", n);
+            u64 started = now();
+            begin_profile_block(labels[n - 1]);
+            profile_block_bytes(infile.size);
+            f64 avg = average_parallel(infile, kernel, n, &count);
+            end_profile_block();
+            f64 seconds = (f64)(now() - started) / Seconds;
+            if (n == 1) {
+                one_thread_seconds = seconds;
+                expected = avg;
+            }
+            f64 error = (expected) ? fabs(avg - expected) / expected : 0;
+            printf("%2d threads: %.3fs, %.2fx, avg of %lu records %.6f (%.1e off)\n",
+                   n, seconds, one_thread_seconds / seconds, count, avg, error);
+            if (error > AVERAGE_TOLERANCE) {
+                fprintf(stderr, "Average with %d threads is off by more than %.0e\n", n, AVERAGE_TOLERANCE);
+                return 1;
+            }
+        }
+    }
+
+    unmap_file(&infile);
+
+    end_and_print_profile();
+}
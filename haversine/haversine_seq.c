@@ -7,9 +7,8 @@
 
 #include "../basic.h"
 #include "../perf/perf.h"
-
-#define sqr(a) ((a) * (a))
-#define pi 3.14159265358979323846f
+#include "distance.h"
+#include "parse.h"
 
 #ifdef DEBUG
 #define debugf(fmt, ...) printf(fmt, __VA_ARGS__);
@@ -17,24 +16,6 @@
 #define debugf(...)
 #endif
 
-static inline f32
-radians(f32 degrees) {
-    f32 result = degrees * pi / 180.0f;
-    return result;
-}
-
-static inline f32
-haversine_distance(f32 x0, f32 y0, f32 x1, f32 y1, f32 radius) {
-    f32 dY = radians(y1 - y0);
-    f32 dX = radians(x1 - x0);
-    y0 = radians(y0);
-    y1 = radians(y1);
-
-    f32 root = (sqr(sinf(dY/2.0f))) + cosf(y0) * cosf(y1) * sqr(sin(dX/2));
-    f32 result = 2.0f * radius * asin(sqrt(root));
-    return result;
-}
-
 int
 main() {
     begin_profile();
@@ -43,8 +24,8 @@ main() {
     const char *inpath = "data.json";
 
     printf("Reading from %s\n", inpath);
-    FILE *infile = fopen(inpath, "r");
-    assert(infile);
+    struct mapped_file infile = map_file(inpath);
+    profile_block_bytes(infile.size);
 
     int count = 0;
     f32 sum = 0;
@@ -54,43 +35,30 @@ main() {
     f32 *points = malloc(npoints * 4 * sizeof(f32));
     assert(points);
 
-    // NOTE: skip to the first record
+    const char *at = infile.data;
+    count = parse_points(&at, infile.data + infile.size, points, npoints);
+#ifdef DEBUG
+    // NOTE: the same records through fscanf, bit for bit
     {
-        char buf[256];
-        int nread = fread(buf, 1, len(buf), infile);
-        assert(nread > 0);
-
-        for (int i = 1; i < nread; i++) {
-            if (buf[i] == '{') {
-                debugf("Found { at %d: %.*s\n", i, 10, buf + i);
-                fseek(infile, i, SEEK_SET);
-                break;
-            }
+        FILE *check = fopen(inpath, "r");
+        assert(check);
+        fscanf(check, "{\n    pairs: [\n");
+        for (int i = 0; i < count; i++) {
+            f32 values[4];
+            int nscanned = fscanf(check, " {\"x0\": %f, \"y0\": %f, \"x1\": %f, \"y1\": %f},", values + 0, values + 1, values + 2, values + 3);
+            assert(nscanned == 4);
+            assert(memcmp(values, points + 4*i, sizeof(values)) == 0);
         }
+        fclose(check);
     }
-
-
-    while (true) {
-        f32 *x0 = points + 4*count + 0;
-        f32 *y0 = points + 4*count + 1;
-        f32 *x1 = points + 4*count + 2;
-        f32 *y1 = points + 4*count + 3;
-        int nscanned = fscanf(infile, "{\"x0\": %f, \"y0\": %f, \"x1\": %f, \"y1\": %f}", x0, y0, x1, y1);
-        if (nscanned == 0) {
-            break;
-        }
-
-        debugf("Got %f %f, %f %f\n", x0, y0, x1, y1);
-
-        fscanf(infile, ",\n");
-        assert(count++ < npoints);
-    }
+#endif
     assert(count == npoints);
-    fclose(infile);
+    unmap_file(&infile);
 
     end_profile_block();
 
     begin_profile_block("Haversines");
+    profile_block_bytes(npoints * 4 * sizeof(f32));
     for (int i = 0; i < npoints; i++) {
         f32 x0 = points[4*i + 0];
         f32 y0 = points[4*i + 1];
@@ -100,8 +68,49 @@ main() {
     }
     end_profile_block();
 
+    begin_profile_block("SoA");
+    f32 *soa = malloc(npoints * 5 * sizeof(f32));
+    assert(soa);
+    f32 *xs0 = soa;
+    f32 *ys0 = soa + npoints;
+    f32 *xs1 = soa + 2*npoints;
+    f32 *ys1 = soa + 3*npoints;
+    f32 *distances = soa + 4*npoints;
+    for (int i = 0; i < npoints; i++) {
+        xs0[i] = points[4*i + 0];
+        ys0[i] = points[4*i + 1];
+        xs1[i] = points[4*i + 2];
+        ys1[i] = points[4*i + 3];
+    }
+    end_profile_block();
+
+    begin_profile_block("Haversines batch");
+    profile_block_bytes(npoints * 4 * sizeof(f32));
+    haversine_distances(xs0, ys0, xs1, ys1, distances, npoints, earth_radius_km);
+    f32 batch_sum = 0;
+    for (int i = 0; i < npoints; i++) {
+        batch_sum += distances[i];
+    }
+    end_profile_block();
+#ifdef DEBUG
+    {
+        f32 max_error = 0;
+        for (int i = 0; i < npoints; i++) {
+            f32 expected = haversine_distance(xs0[i], ys0[i], xs1[i], ys1[i], earth_radius_km);
+            f32 error = fabsf(distances[i] - expected);
+            max_error = (error > max_error) ? error : max_error;
+        }
+        printf("Batch max error: %fkm\n", max_error);
+        assert(max_error <= HAVERSINE_MAX_ERROR_KM);
+    }
+#endif
+
     f32 avg = sum / count;
     printf("Avg of %d records: %f\n", count, avg);
+    printf("Batch avg: %f\n", batch_sum / count);
+
+    free(soa);
+    free(points);
 
     end_and_print_profile();
 }
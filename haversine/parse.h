@@ -0,0 +1,464 @@
+#pragma once
+
+#include <fcntl.h>
+#include <float.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#ifndef assert
+#include <assert.h>
+#endif
+
+#include "../basic.h"
+
+struct mapped_file {
+    const char *data;
+    u64 size;
+};
+
+static inline struct mapped_file
+map_file(const char *path) {
+    struct mapped_file result = {};
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    int error = fstat(fd, &st);
+    assert(!error);
+    result.size = st.st_size;
+    if (result.size) {
+        void *data = mmap(NULL, result.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        assert(data != MAP_FAILED);
+        madvise(data, result.size, MADV_SEQUENTIAL);
+        result.data = data;
+    }
+    close(fd);
+    return result;
+}
+
+static inline void
+unmap_file(struct mapped_file *file) {
+    if (file->data) {
+        munmap((void *)file->data, file->size);
+    }
+    *file = (struct mapped_file){};
+}
+
+static inline bool
+is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// NOTE: exactly representable in f64, so a division by one rounds once
+static const f64 parse_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// NOTE: anything strtof may read, copied out since the mapping has no NUL
+static inline f32
+parse_f32_slow(const char **at, const char *end) {
+    char text[64];
+    u32 n = 0;
+    for (const char *p = *at; p < end && n < len(text) - 1; p++) {
+        char c = *p;
+        if (!is_digit(c) && c != '-' && c != '+' && c != '.' && c != 'e' && c != 'E') {
+            break;
+        }
+        text[n++] = c;
+    }
+    text[n] = '\0';
+    char *stop;
+    f32 result = strtof(text, &stop);
+    *at += stop - text;
+    return result;
+}
+
+// NOTE: mantissa / 10^nfraction the way strtof rounds it, for up to 15
+// digits: those make an exact integer and a power of ten up to 1e22 is exact
+// too, so the f64 quotient is correctly rounded. Rounding that to f32 again
+// only differs from rounding the decimal directly when the f64 lands exactly
+// halfway between two f32s, false for those and outside the normal f32 range
+static inline bool
+parse_f32_round(u64 mantissa, u32 nfraction, bool negative, f32 *result) {
+    f64 value = (f64)mantissa / parse_powers_of_ten[nfraction];
+    u64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    // NOTE: the 29 f64 mantissa bits that f32 drops, 1 and 28 zeros is a tie
+    bool tie = (bits & ((1ull << 29) - 1)) == (1ull << 28);
+    bool normal = value == 0 || (value >= FLT_MIN && value <= FLT_MAX);
+    if (tie || !normal) {
+        return false;
+    }
+    *result = (negative) ? -(f32)value : (f32)value;
+    return true;
+}
+
+// NOTE: the f32 strtof returns for the number at *at, without libc for plain
+// decimals, anything with an exponent or more than 15 digits goes to strtof
+static inline f32
+parse_f32(const char **at, const char *end) {
+    const char *p = *at;
+    bool negative = p < end && *p == '-';
+    p += negative;
+
+    u64 mantissa = 0;
+    int ndigits = 0;
+    int nfraction = 0;
+    while (p < end && is_digit(*p)) {
+        mantissa = mantissa * 10 + (*p++ - '0');
+        ndigits++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && is_digit(*p)) {
+            mantissa = mantissa * 10 + (*p++ - '0');
+            ndigits++;
+            nfraction++;
+        }
+    }
+
+    bool exponent = p < end && (*p == 'e' || *p == 'E');
+    f32 result;
+    if (ndigits > 0 && ndigits <= 15 && !exponent && parse_f32_round(mantissa, nfraction, negative, &result)) {
+        *at = p;
+        return result;
+    }
+    return parse_f32_slow(at, end);
+}
+
+// NOTE: points of {"x0": .., "y0": .., "x1": .., "y1": ..} records, straight
+// from the file: every quoted key is looked at, x0/y0/x1/y1 pick the slot of
+// the value after the colon and the fourth value ends a record, anything
+// else in between is skipped. Returns the number of records, *at is left
+// after the last one so the next call continues from there
+static inline u64
+parse_points_scalar(const char **cursor, const char *end, f32 *points, u64 max_points) {
+    const char *at = *cursor;
+    u64 count = 0;
+    int nvalues = 0;
+    while (count < max_points) {
+        at = memchr(at, '"', end - at);
+        if (!at) {
+            break;
+        }
+        const char *key = ++at;
+        at = memchr(at, '"', end - at);
+        if (!at) {
+            break;
+        }
+        u64 key_size = at++ - key;
+        if (key_size != 2 || (key[0] != 'x' && key[0] != 'y') || (key[1] != '0' && key[1] != '1')) {
+            continue;
+        }
+        int slot = (key[1] - '0') * 2 + (key[0] == 'y');
+
+        while (at < end && (*at == ' ' || *at == ':')) {
+            at++;
+        }
+        points[4*count + slot] = parse_f32(&at, end);
+        if (++nvalues == 4) {
+            nvalues = 0;
+            count++;
+            *cursor = at;
+        }
+    }
+    return count;
+}
+
+// NOTE: the SIMD kernels look at the file 64 bytes at a time: masks of the
+// digits, dots, minus signs, quotes and the spaces/colons in front of values
+// give the keys ("xN" is a quote with another quote 3 bytes later) and where
+// every number starts and its digit runs end. Only events in the first 48
+// bytes are taken, so a number has the rest of the window to end in and the
+// next window starts where the last one stopped. The digit runs are then
+// converted together with pshufb + pmaddubsw/pmaddwd and rounded like the
+// scalar parse_f32, anything it would send to strtof still goes there
+#define PARSE_WINDOW_SIZE 64
+#define PARSE_WINDOW_STEP 48
+// NOTE: the 16 byte digit loads may start anywhere in the window
+#define PARSE_WINDOW_READ (PARSE_WINDOW_SIZE + 16)
+
+struct parse_masks {
+    u64 digit;
+    u64 dot;
+    u64 minus;
+    u64 quote;
+    u64 separator;
+};
+
+// NOTE: a number to convert, positions are window offsets
+struct parse_number {
+    f32 *out;
+    u8 start;
+    u8 integer; // NOTE: first integer digit
+    u8 fraction; // NOTE: first fraction digit
+    u8 nintegers;
+    u8 nfractions;
+    bool negative;
+};
+
+struct parse_state {
+    const char **cursor;
+    const char *end;
+    f32 *points;
+    u64 max_points;
+    u64 count;
+    int nvalues;
+    int slot; // NOTE: of the last key, -1 - none or already has its value
+};
+
+static const u64 parse_integer_powers_of_ten[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+    100000000ull, 1000000000ull, 10000000000ull, 100000000000ull,
+    1000000000000ull, 10000000000000ull, 100000000000000ull, 1000000000000000ull,
+};
+
+// NOTE: a pshufb control loaded at n moves the first n bytes to the top of a
+// register and zeroes the rest, the digits then line up by place value
+static const u8 parse_align_digits[32] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+// NOTE: a value is in, the fourth completes a record
+static inline void
+parse_value_done(struct parse_state *state, const char *after) {
+    if (++state->nvalues == 4) {
+        state->nvalues = 0;
+        state->count++;
+        *state->cursor = after;
+    }
+}
+
+// NOTE: walks the keys and numbers of one window, plain numbers are queued
+// for the SIMD conversion and the rest parsed right away. Returns how many
+// were queued, *next is where the following window starts. Always inlined,
+// as a call the state lives in memory and the kernels lose most of their gain
+__attribute__((always_inline))
+static inline u32
+parse_window(struct parse_state *state, const char *base, struct parse_masks m,
+             struct parse_number *numbers, const char **next) {
+    u64 starts = (m.digit | m.dot | m.minus) & (m.separator << 1);
+    u64 keys = m.quote & (m.quote >> 3);
+    u64 events = (starts | keys) & ((1ull << PARSE_WINDOW_STEP) - 2);
+    const char *resume = base + PARSE_WINDOW_STEP;
+    u32 nnumbers = 0;
+    while (events && state->count < state->max_points) {
+        u32 i = __builtin_ctzll(events);
+        events &= events - 1;
+        if ((keys >> i) & 1) {
+            char axis = base[i + 1];
+            char index = base[i + 2];
+            bool point = (axis == 'x' || axis == 'y') && (index == '0' || index == '1');
+            state->slot = (point) ? (index - '0') * 2 + (axis == 'y') : -1;
+            continue;
+        }
+        if (state->slot < 0) {
+            continue;
+        }
+        f32 *out = state->points + 4*state->count + state->slot;
+        state->slot = -1;
+
+        bool negative = (m.minus >> i) & 1;
+        u32 integer = i + negative;
+        u32 nintegers = __builtin_ctzll(~(m.digit >> integer));
+        u32 fraction = integer + nintegers;
+        u32 nfractions = 0;
+        if (fraction < PARSE_WINDOW_SIZE && ((m.dot >> fraction) & 1)) {
+            fraction++;
+            nfractions = (fraction < PARSE_WINDOW_SIZE) ? __builtin_ctzll(~(m.digit >> fraction)) : 0;
+        }
+        u32 after = fraction + nfractions;
+        u32 ndigits = nintegers + nfractions;
+        bool plain = after < PARSE_WINDOW_SIZE && base[after] != 'e' && base[after] != 'E';
+        if (plain && ndigits > 0 && ndigits <= 15) {
+            numbers[nnumbers++] = (struct parse_number){
+                .out = out,
+                .start = i,
+                .integer = integer,
+                .fraction = fraction,
+                .nintegers = nintegers,
+                .nfractions = nfractions,
+                .negative = negative,
+            };
+            parse_value_done(state, base + after);
+            resume = (base + after > resume) ? base + after : resume;
+        } else {
+            const char *at = base + i;
+            *out = parse_f32_slow(&at, state->end);
+            parse_value_done(state, at);
+            resume = (at > resume) ? at : resume;
+        }
+    }
+    // NOTE: one byte back, the first byte of a window is only context
+    *next = resume - 1;
+    return nnumbers;
+}
+
+// NOTE: a queued number from its two digit runs, ties go to strtof
+static inline void
+parse_finish(const char *base, const char *end, struct parse_number *number, u64 integer, u64 fraction) {
+    u64 mantissa = integer * parse_integer_powers_of_ten[number->nfractions] + fraction;
+    if (!parse_f32_round(mantissa, number->nfractions, number->negative, number->out)) {
+        const char *at = base + number->start;
+        *number->out = parse_f32_slow(&at, end);
+    }
+}
+
+__attribute__((target("sse4.1")))
+static inline struct parse_masks
+parse_masks_sse(const char *base) {
+    struct parse_masks result = {};
+    for (int i = 0; i < PARSE_WINDOW_SIZE; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(base + i));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+        __m128i separator = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                                         _mm_cmpeq_epi8(bytes, _mm_set1_epi8(':')));
+        result.digit |= (u64)(u16)_mm_movemask_epi8(digit) << i;
+        result.dot |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('.'))) << i;
+        result.minus |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('-'))) << i;
+        result.quote |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('"'))) << i;
+        result.separator |= (u64)(u16)_mm_movemask_epi8(separator) << i;
+    }
+    return result;
+}
+
+// NOTE: up to 16 digits at p as two 8 digit halves in the low two u32s
+__attribute__((target("sse4.1")))
+static inline __m128i
+parse_digits_sse(const char *p, u32 ndigits) {
+    __m128i digits = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi8('0'));
+    digits = _mm_shuffle_epi8(digits, _mm_loadu_si128((const __m128i *)(parse_align_digits + ndigits)));
+    __m128i pairs = _mm_maddubs_epi16(digits, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+    quads = _mm_packus_epi32(quads, quads);
+    return _mm_madd_epi16(quads, _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+}
+
+__attribute__((target("sse4.1")))
+static u64
+parse_points_sse(const char **cursor, const char *end, f32 *points, u64 max_points) {
+    struct parse_state state = {cursor, end, points, max_points, .slot = -1};
+    struct parse_number numbers[PARSE_WINDOW_STEP / 2];
+    const char *base = *cursor;
+    while (end - base >= PARSE_WINDOW_READ && state.count < max_points) {
+        const char *next;
+        u32 nnumbers = parse_window(&state, base, parse_masks_sse(base), numbers, &next);
+        for (u32 i = 0; i < nnumbers; i++) {
+            struct parse_number *number = numbers + i;
+            __m128i integer = parse_digits_sse(base + number->integer, number->nintegers);
+            __m128i fraction = parse_digits_sse(base + number->fraction, number->nfractions);
+            u64 integer_value = (u64)_mm_extract_epi32(integer, 0) * 100000000 + (u32)_mm_extract_epi32(integer, 1);
+            u64 fraction_value = (u64)_mm_extract_epi32(fraction, 0) * 100000000 + (u32)_mm_extract_epi32(fraction, 1);
+            parse_finish(base, end, number, integer_value, fraction_value);
+        }
+        base = next;
+    }
+    // NOTE: the tail, from the end of the last whole record
+    return state.count + parse_points_scalar(cursor, end, points + 4*state.count, max_points - state.count);
+}
+
+__attribute__((target("avx2")))
+static inline struct parse_masks
+parse_masks_avx2(const char *base) {
+    struct parse_masks result = {};
+    for (int i = 0; i < PARSE_WINDOW_SIZE; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(base + i));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('0' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), bytes));
+        __m256i separator = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+                                            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(':')));
+        result.digit |= (u64)(u32)_mm256_movemask_epi8(digit) << i;
+        result.dot |= (u64)(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('.'))) << i;
+        result.minus |= (u64)(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('-'))) << i;
+        result.quote |= (u64)(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"'))) << i;
+        result.separator |= (u64)(u32)_mm256_movemask_epi8(separator) << i;
+    }
+    return result;
+}
+
+// NOTE: both digit runs of a number at once, the integer part in the low
+// lane and the fraction in the high one, same steps as parse_digits_sse
+__attribute__((target("avx2")))
+static inline __m256i
+parse_digits_avx2(const char *integer, u32 nintegers, const char *fraction, u32 nfractions) {
+    __m256i digits = _mm256_loadu2_m128i((const __m128i *)fraction, (const __m128i *)integer);
+    __m256i align = _mm256_loadu2_m128i((const __m128i *)(parse_align_digits + nfractions),
+                                        (const __m128i *)(parse_align_digits + nintegers));
+    digits = _mm256_shuffle_epi8(_mm256_sub_epi8(digits, _mm256_set1_epi8('0')), align);
+    __m256i pairs = _mm256_maddubs_epi16(digits, _mm256_set1_epi16(0x010a));
+    __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00010064));
+    quads = _mm256_packus_epi32(quads, quads);
+    return _mm256_madd_epi16(quads, _mm256_set1_epi32(0x00012710));
+}
+
+__attribute__((target("avx2")))
+static u64
+parse_points_avx2(const char **cursor, const char *end, f32 *points, u64 max_points) {
+    struct parse_state state = {cursor, end, points, max_points, .slot = -1};
+    struct parse_number numbers[PARSE_WINDOW_STEP / 2];
+    const char *base = *cursor;
+    while (end - base >= PARSE_WINDOW_READ && state.count < max_points) {
+        const char *next;
+        u32 nnumbers = parse_window(&state, base, parse_masks_avx2(base), numbers, &next);
+        for (u32 i = 0; i < nnumbers; i++) {
+            struct parse_number *number = numbers + i;
+            __m256i halves = parse_digits_avx2(base + number->integer, number->nintegers,
+                                               base + number->fraction, number->nfractions);
+            u64 integer = (u64)_mm256_extract_epi32(halves, 0) * 100000000 + (u32)_mm256_extract_epi32(halves, 1);
+            u64 fraction = (u64)_mm256_extract_epi32(halves, 4) * 100000000 + (u32)_mm256_extract_epi32(halves, 5);
+            parse_finish(base, end, number, integer, fraction);
+        }
+        base = next;
+    }
+    return state.count + parse_points_scalar(cursor, end, points + 4*state.count, max_points - state.count);
+}
+
+enum parse_kernel {
+    parse_kernel_SCALAR,
+    parse_kernel_SSE,
+    parse_kernel_AVX2,
+
+    parse_kernel_num,
+};
+
+// NOTE: the widest kernel the CPU has, from CPUID (and XGETBV for the AVX state)
+static inline enum parse_kernel
+parse_best_kernel(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return parse_kernel_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return parse_kernel_SSE;
+    }
+    return parse_kernel_SCALAR;
+}
+
+static inline u64
+parse_points_with(enum parse_kernel kernel, const char **cursor, const char *end, f32 *points, u64 max_points) {
+    switch (kernel) {
+    case parse_kernel_SCALAR: return parse_points_scalar(cursor, end, points, max_points);
+    case parse_kernel_SSE: return parse_points_sse(cursor, end, points, max_points);
+    case parse_kernel_AVX2: return parse_points_avx2(cursor, end, points, max_points);
+    case parse_kernel_num: break;
+    }
+    assert(false);
+    return 0;
+}
+
+static inline u64
+parse_points(const char **cursor, const char *end, f32 *points, u64 max_points) {
+    static enum parse_kernel kernel = parse_kernel_num;
+    if (kernel == parse_kernel_num) {
+        kernel = parse_best_kernel();
+    }
+    return parse_points_with(kernel, cursor, end, points, max_points);
+}
@@ -0,0 +1,53 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../basic.h"
+#include "../perf/perf.h"
+#include "parse.h"
+
+// NOTE: every parse kernel the CPU runs over the same data.json, the output
+// has to match the scalar one bit for bit
+int
+main(int argc, char *argv[]) {
+    const char *inpath = (argc > 1) ? argv[1] : "data.json";
+    const int nruns = 3;
+    static const char *labels[parse_kernel_num] = {"Parse scalar", "Parse SSE", "Parse AVX2"};
+
+    struct mapped_file infile = map_file(inpath);
+    // NOTE: a record is at least {"x0":0,"y0":0,"x1":0,"y1":0}
+    u64 max_points = infile.size / 29 + 1;
+    f32 *expected = malloc(max_points * 4 * sizeof(f32));
+    f32 *points = malloc(max_points * 4 * sizeof(f32));
+    assert(expected && points);
+
+    enum parse_kernel best = parse_best_kernel();
+    printf("Parsing %s (%lu bytes), best kernel %s\n", inpath, infile.size, labels[best]);
+
+    // NOTE: also pulls the file into the page cache before the timed runs
+    const char *at = infile.data;
+    u64 count = parse_points_with(parse_kernel_SCALAR, &at, infile.data + infile.size, expected, max_points);
+    printf("%lu records\n", count);
+
+    begin_profile();
+    for (enum parse_kernel kernel = 0; kernel <= best; kernel++) {
+        for (int run = 0; run < nruns; run++) {
+            memset(points, 0, count * 4 * sizeof(f32));
+            begin_profile_block(labels[kernel]);
+            profile_block_bytes(infile.size);
+            at = infile.data;
+            u64 n = parse_points_with(kernel, &at, infile.data + infile.size, points, max_points);
+            end_profile_block();
+            if (n != count || memcmp(points, expected, count * 4 * sizeof(f32)) != 0) {
+                fprintf(stderr, "%s: output differs from scalar\n", labels[kernel]);
+                return 1;
+            }
+        }
+    }
+    end_and_print_profile();
+
+    free(points);
+    free(expected);
+    unmap_file(&infile);
+}
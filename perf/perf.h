@@ -46,6 +46,7 @@ struct _profile_block {
     u64 begin_cycles;
     u64 end_cycles;
     const char *label;
+    u64 nbytes; // NOTE: bytes processed, printed as throughput when set
 };
 
     struct {
@@ -63,6 +64,13 @@ static inline void
 begin_profile_block(const char *label) {
     _profile.blocks[_profile.nblocks].begin_cycles = rdtsc();
     _profile.blocks[_profile.nblocks].label = label;
+    _profile.blocks[_profile.nblocks].nbytes = 0;
+}
+
+// NOTE: for the block that is open, may be called once the size is known
+static inline void
+profile_block_bytes(u64 nbytes) {
+    _profile.blocks[_profile.nblocks].nbytes = nbytes;
 }
 
 static inline void
@@ -85,6 +93,11 @@ end_and_print_profile(void) {
         struct _profile_block *block = _profile.blocks + i;
         u64 elapsed_cycles = block->end_cycles - block->begin_cycles;
         f64 percentage = (f64)elapsed_cycles / (f64) total_cycles * 100.0;
-        printf("%20s :: %12ld (%.2f%%)\n", block->label, elapsed_cycles, percentage);
+        printf("%20s :: %12ld (%.2f%%)", block->label, elapsed_cycles, percentage);
+        if (block->nbytes) {
+            f64 seconds = (f64)elapsed_cycles / cpu_freq;
+            printf(" %.3fGB/s", block->nbytes / seconds / 1e9);
+        }
+        printf("\n");
     }
 }